@@ -1,14 +1,17 @@
 #pragma once
 
 #include <libspotify/api.h>
+#include <memory>
 #include "SpotifySession.h"
 #include "util.h"
 
+/** Low priority threads, such as the art prefetcher's, run at normal priority while they hold the spotify lock,
+ * so that they can't keep playback waiting on it. */
 class SpotifyLockScope : public LockedCS
 {
 public:
-	SpotifyLockScope(SpotifySession & session = SpotifySession::instance())
-		: LockedCS(session.getSpotifyCS())
+	SpotifyLockScope(LockSite & site, SpotifySession & session = SpotifySession::instance())
+		: LockedCS(session.getSpotifyCS(), site, true)
 	{
 	}
 };
@@ -24,8 +27,24 @@ typedef SpotifyPtr<sp_image> SpotifyImagePtr;
 typedef SpotifyPtr<sp_link> SpotifyLinkPtr;
 typedef SpotifyPtr<sp_playlist> SpotifyPlaylistPtr;
 typedef SpotifyPtr<sp_search> SpotifySearchPtr;
+typedef SpotifyPtr<sp_toplistbrowse> SpotifyToplistBrowsePtr;
 typedef SpotifyPtr<sp_track> SpotifyTrackPtr;
 
+/** libspotify callback for objects that stay registered (image load, playlist state); userdata is an Event. */
+template <typename T>
+void SP_CALLCONV SpotifySignalLoaded(T *, void * userdata)
+{
+	SetEvent(static_cast<Event *>(userdata)->handle);
+}
+
+/** libspotify complete callback for the browse types and search; userdata is the future's SpotifyFuture::CallbackHandle.
+ * libspotify may call it until the object is released, so the handle is only closed then, see SpotifyReleaseClosing. */
+template <typename T>
+void SP_CALLCONV SpotifySignalComplete(T *, void * userdata)
+{
+	SetEvent(static_cast<HANDLE>(userdata));
+}
+
 template <typename T>
 struct SpotifyTraits
 {
@@ -45,6 +64,14 @@ struct SpotifyTraits<sp_album>
 	static bool IsLoaded(sp_album * album) {
 		return sp_album_is_loaded(album);
 	}
+
+	static void Watch(sp_album *, Event & ev) {
+		SpotifySession::instance().addMetadataWaiter(ev);
+	}
+
+	static void Unwatch(sp_album *, Event & ev) {
+		SpotifySession::instance().removeMetadataWaiter(ev);
+	}
 };
 
 template <>
@@ -61,6 +88,13 @@ struct SpotifyTraits<sp_albumbrowse>
 	static bool IsLoaded(sp_albumbrowse * albumbrowse) {
 		return sp_albumbrowse_is_loaded(albumbrowse);
 	}
+
+	// Completion is signalled by the callback passed to sp_albumbrowse_create.
+	static void Watch(sp_albumbrowse *, Event &) {
+	}
+
+	static void Unwatch(sp_albumbrowse *, Event &) {
+	}
 };
 
 template <>
@@ -77,6 +111,14 @@ struct SpotifyTraits<sp_artist>
 	static bool IsLoaded(sp_artist * artist) {
 		return sp_artist_is_loaded(artist);
 	}
+
+	static void Watch(sp_artist *, Event & ev) {
+		SpotifySession::instance().addMetadataWaiter(ev);
+	}
+
+	static void Unwatch(sp_artist *, Event & ev) {
+		SpotifySession::instance().removeMetadataWaiter(ev);
+	}
 };
 
 template <>
@@ -93,6 +135,13 @@ struct SpotifyTraits<sp_artistbrowse>
 	static bool IsLoaded(sp_artistbrowse * artistbrowse) {
 		return sp_artistbrowse_is_loaded(artistbrowse);
 	}
+
+	// Completion is signalled by the callback passed to sp_artistbrowse_create.
+	static void Watch(sp_artistbrowse *, Event &) {
+	}
+
+	static void Unwatch(sp_artistbrowse *, Event &) {
+	}
 };
 
 template <>
@@ -109,6 +158,18 @@ struct SpotifyTraits<sp_image>
 	static bool IsLoaded(sp_image * image) {
 		return sp_image_is_loaded(image);
 	}
+
+	static void Watch(sp_image * image, Event & ev) {
+		sp_image_add_load_callback(image, &SpotifySignalLoaded<sp_image>, &ev);
+	}
+
+	/** A future can outlive the session; the callback went with it, so there's nothing to remove then. */
+	static void Unwatch(sp_image * image, Event & ev) {
+		DECLARE_LOCK_SITE(site);
+		SpotifyLockScope lock(site);
+		if (!SpotifySession::instance().isReleased())
+			sp_image_remove_load_callback(image, &SpotifySignalLoaded<sp_image>, &ev);
+	}
 };
 
 template <>
@@ -137,6 +198,24 @@ struct SpotifyTraits<sp_playlist>
 	static bool IsLoaded(sp_playlist * playlist) {
 		return sp_playlist_is_loaded(playlist);
 	}
+
+	static void Watch(sp_playlist * playlist, Event & ev) {
+		sp_playlist_add_callbacks(playlist, &Callbacks(), &ev);
+	}
+
+	/** As for images. */
+	static void Unwatch(sp_playlist * playlist, Event & ev) {
+		DECLARE_LOCK_SITE(site);
+		SpotifyLockScope lock(site);
+		if (!SpotifySession::instance().isReleased())
+			sp_playlist_remove_callbacks(playlist, &Callbacks(), &ev);
+	}
+
+	static sp_playlist_callbacks & Callbacks() {
+		// Only playlist_state_changed, the fifth member, is of interest.
+		static sp_playlist_callbacks callbacks = { nullptr, nullptr, nullptr, nullptr, &SpotifySignalLoaded<sp_playlist> };
+		return callbacks;
+	}
 };
 
 template <>
@@ -153,6 +232,14 @@ struct SpotifyTraits<sp_track>
 	static bool IsLoaded(sp_track * track) {
 		return sp_track_is_loaded(track);
 	}
+
+	static void Watch(sp_track *, Event & ev) {
+		SpotifySession::instance().addMetadataWaiter(ev);
+	}
+
+	static void Unwatch(sp_track *, Event & ev) {
+		SpotifySession::instance().removeMetadataWaiter(ev);
+	}
 };
 
 template <>
@@ -169,28 +256,274 @@ struct SpotifyTraits<sp_search>
 	static bool IsLoaded(sp_search * search) {
 		return sp_search_is_loaded(search);
 	}
+
+	// Completion is signalled by the callback passed to sp_search_create.
+	static void Watch(sp_search *, Event &) {
+	}
+
+	static void Unwatch(sp_search *, Event &) {
+	}
+};
+
+template <>
+struct SpotifyTraits<sp_toplistbrowse>
+{
+	static void AddRef(sp_toplistbrowse * toplistbrowse) {
+		sp_toplistbrowse_add_ref(toplistbrowse);
+	}
+
+	static void Release(sp_toplistbrowse * toplistbrowse) {
+		sp_toplistbrowse_release(toplistbrowse);
+	}
+
+	static bool IsLoaded(sp_toplistbrowse * toplistbrowse) {
+		return sp_toplistbrowse_is_loaded(toplistbrowse);
+	}
+
+	// Completion is signalled by the callback passed to sp_toplistbrowse_create.
+	static void Watch(sp_toplistbrowse *, Event &) {
+	}
+
+	static void Unwatch(sp_toplistbrowse *, Event &) {
+	}
 };
 
+/** libspotify isn't thread safe, so this does need the lock; it is nearly always held already, which makes taking it again cheap. */
 template <typename T>
 void SpotifyAddRef(T * ptr)
 {
-	SpotifyLockScope lock;
-	SpotifyTraits<T>::AddRef(ptr);
+	DECLARE_LOCK_SITE(site);
+	SpotifyLockScope lock(site);
+	if (!SpotifySession::instance().isReleased())
+		SpotifyTraits<T>::AddRef(ptr);
+}
+
+template <typename T>
+void SpotifyReleaseDeferred(void * ptr)
+{
+	SpotifyTraits<T>::Release(static_cast<T *>(ptr));
 }
 
+/** Releases straight away if the lock is free (or already ours), otherwise leaves it to the session thread rather than wait.
+ * References that outlive the session, say in an input still open at shutdown, are simply dropped. */
 template <typename T>
 void SpotifyRelease(T * ptr)
 {
-	SpotifyLockScope lock;
-	SpotifyTraits<T>::Release(ptr);
+	SpotifySession & session = SpotifySession::instance();
+	CriticalSection & cs = session.getSpotifyCS();
+	if (TryEnterCriticalSection(&cs.cs))
+	{
+		if (!session.isReleased())
+			SpotifyTraits<T>::Release(ptr);
+		LeaveCriticalSection(&cs.cs);
+	}
+	else
+	{
+		session.deferRelease(&SpotifyReleaseDeferred<T>, ptr);
+	}
+}
+
+/** An object whose complete callback was given handle, and the handle. */
+template <typename T>
+struct SpotifyCallbackRelease
+{
+	T * ptr;
+	HANDLE handle;
+};
+
+template <typename T>
+void SpotifyReleaseClosingDeferred(void * data)
+{
+	SpotifyCallbackRelease<T> * release = static_cast<SpotifyCallbackRelease<T> *>(data);
+	SpotifyTraits<T>::Release(release->ptr);
+	CloseHandle(release->handle);
+	delete release;
+}
+
+/** Like SpotifyRelease, and closes the handle its complete callback was given along with it:
+ * the callback may fire right up to the release, whether or not it has already. */
+template <typename T>
+void SpotifyReleaseClosing(T * ptr, HANDLE handle)
+{
+	SpotifySession & session = SpotifySession::instance();
+	CriticalSection & cs = session.getSpotifyCS();
+	if (TryEnterCriticalSection(&cs.cs))
+	{
+		if (!session.isReleased())
+			SpotifyTraits<T>::Release(ptr);
+		CloseHandle(handle);
+		LeaveCriticalSection(&cs.cs);
+	}
+	else
+	{
+		SpotifyCallbackRelease<T> * release = new SpotifyCallbackRelease<T>;
+		release->ptr = ptr;
+		release->handle = handle;
+		session.deferRelease(&SpotifyReleaseClosingDeferred<T>, release);
+	}
+}
+
+/** A libspotify object that may still be loading.
+ *
+ * Completion is signalled either by the complete callback given to the create call (browse types, search),
+ * or through SpotifyTraits<T>::Watch (image and playlist callbacks, metadata_updated for the rest),
+ * so wait() blocks on an event rather than polling.
+ * Use the Spotify*Async functions to start loads; create, wait on and destroy futures with the spotify lock held.
+ */
+template <typename T>
+class SpotifyFuture : boost::noncopyable
+{
+public:
+	SpotifyFuture()
+		: m_ptr(nullptr)
+		, m_event(new Event(FALSE, FALSE))
+		, m_callbackHandle(NULL)
+	{
+	}
+
+	/** Waits for an object that is already around, adding a reference of its own. */
+	explicit SpotifyFuture(T * ptr)
+		: m_ptr(nullptr)
+		, m_event(new Event(FALSE, FALSE))
+		, m_callbackHandle(NULL)
+	{
+		if (ptr != nullptr)
+		{
+			SpotifyAddRef(ptr);
+			Attach(ptr);
+		}
+	}
+
+	SpotifyFuture(SpotifyFuture && other)
+		: m_ptr(other.m_ptr)
+		, m_event(std::move(other.m_event))
+		, m_callbackHandle(other.m_callbackHandle)
+	{
+		other.m_ptr = nullptr;
+		other.m_callbackHandle = NULL;
+	}
+
+	~SpotifyFuture()
+	{
+		if (m_ptr != nullptr)
+		{
+			SpotifyTraits<T>::Unwatch(m_ptr, *m_event);
+			if (m_callbackHandle != NULL)
+				SpotifyReleaseClosing(m_ptr, m_callbackHandle);
+			else
+				SpotifyRelease(m_ptr);
+		}
+		else if (m_callbackHandle != NULL)
+		{
+			CloseHandle(m_callbackHandle);
+		}
+	}
+
+	/** Takes over the reference returned by a create call. */
+	void Attach(T * ptr)
+	{
+		PFC_ASSERT(m_ptr == nullptr);
+		m_ptr = ptr;
+		if (m_ptr != nullptr)
+		{
+			SpotifyTraits<T>::Watch(m_ptr, *m_event);
+		}
+		else if (m_callbackHandle != NULL)
+		{
+			// The create call failed, so its callback never fires.
+			CloseHandle(m_callbackHandle);
+			m_callbackHandle = NULL;
+		}
+	}
+
+	/** Userdata for a SpotifySignalComplete callback, for the create call whose result is attached next.
+	 * Stays open until that object is released. */
+	HANDLE CallbackHandle()
+	{
+		PFC_ASSERT(m_callbackHandle == NULL);
+		m_callbackHandle = m_event->duplicateHandle();
+		return m_callbackHandle;
+	}
+
+	bool IsReady() const
+	{
+		return m_ptr == nullptr || SpotifyTraits<T>::IsLoaded(m_ptr);
+	}
+
+	/** Drops the lock while waiting. @return the object, or nullptr if the create call failed. */
+	T * Get(LockedCS & lock, abort_callback & abort)
+	{
+		while (!IsReady())
+		{
+			lock.waitForEvent(*m_event, abort);
+		}
+		return m_ptr;
+	}
+
+private:
+	T * m_ptr;
+	std::unique_ptr<Event> m_event;
+	/** A handle of m_event for the complete callback; it may outlive m_event until a deferred release. */
+	HANDLE m_callbackHandle;
+};
+
+inline SpotifyFuture<sp_albumbrowse> SpotifyAlbumBrowseAsync(sp_session * session, sp_album * album)
+{
+	SpotifyFuture<sp_albumbrowse> future;
+	future.Attach(sp_albumbrowse_create(session, album, &SpotifySignalComplete<sp_albumbrowse>, future.CallbackHandle()));
+	return future;
+}
+
+inline SpotifyFuture<sp_artistbrowse> SpotifyArtistBrowseAsync(sp_session * session, sp_artist * artist, sp_artistbrowse_type type)
+{
+	SpotifyFuture<sp_artistbrowse> future;
+	future.Attach(sp_artistbrowse_create(session, artist, type, &SpotifySignalComplete<sp_artistbrowse>, future.CallbackHandle()));
+	return future;
+}
+
+inline SpotifyFuture<sp_search> SpotifySearchAsync(sp_session * session, const char * query, int trackOffset, int trackCount,
+	int albumOffset, int albumCount, int artistOffset, int artistCount, int playlistOffset, int playlistCount, sp_search_type type)
+{
+	SpotifyFuture<sp_search> future;
+	future.Attach(sp_search_create(session, query, trackOffset, trackCount, albumOffset, albumCount, artistOffset, artistCount,
+		playlistOffset, playlistCount, type, &SpotifySignalComplete<sp_search>, future.CallbackHandle()));
+	return future;
+}
+
+inline SpotifyFuture<sp_toplistbrowse> SpotifyToplistBrowseAsync(sp_session * session, sp_toplisttype type, sp_toplistregion region, const char * username)
+{
+	SpotifyFuture<sp_toplistbrowse> future;
+	future.Attach(sp_toplistbrowse_create(session, type, region, username, &SpotifySignalComplete<sp_toplistbrowse>, future.CallbackHandle()));
+	return future;
+}
+
+inline SpotifyFuture<sp_playlist> SpotifyPlaylistAsync(sp_session * session, sp_link * link)
+{
+	SpotifyFuture<sp_playlist> future;
+	future.Attach(sp_playlist_create(session, link));
+	return future;
+}
+
+inline SpotifyFuture<sp_image> SpotifyImageAsync(sp_session * session, const byte * imageId)
+{
+	SpotifyFuture<sp_image> future;
+	future.Attach(sp_image_create(session, imageId));
+	return future;
 }
 
 template <typename T>
 void SpotifyAwaitLoaded(T * ptr, LockedCS &lock, abort_callback &abort)
 {
-	while (!SpotifyTraits<T>::IsLoaded(ptr))
+	SpotifyFuture<T>(ptr).Get(lock, abort);
+}
+
+/** Waits for every future in [begin, end); issue all the loads first so they proceed concurrently. */
+template <typename Iterator>
+void SpotifyWhenAll(Iterator begin, Iterator end, LockedCS & lock, abort_callback & abort)
+{
+	for (; begin != end; ++begin)
 	{
-		lock.wait(abort, 100);
+		begin->Get(lock, abort);
 	}
 }
 
@@ -203,50 +536,71 @@ public:
 	PtrType m_ptr;
 
 	SpotifyPtr()
+		: m_ptr(nullptr)
 	{
-		m_ptr = nullptr;
 	}
 
 	SpotifyPtr(PtrType ptr)
+		: m_ptr(ptr)
 	{
-		m_ptr = ptr;
 		if (m_ptr != nullptr)
 		{
 			SpotifyAddRef(m_ptr);
 		}
 	}
 
-	SpotifyPtr(const SpotifyPtr<PtrType> & other)
+	SpotifyPtr(const SpotifyPtr & other)
+		: m_ptr(other.m_ptr)
 	{
-		m_ptr = other.m_ptr;
 		if (m_ptr != nullptr)
 		{
 			SpotifyAddRef(m_ptr);
 		}
 	}
 
-	SpotifyPtr(SpotifyPtr<PtrType> && other)
+	/** Hands the reference over; noexcept so that std::vector moves rather than copies when it grows. */
+	SpotifyPtr(SpotifyPtr && other) noexcept
+		: m_ptr(other.m_ptr)
 	{
-		m_ptr = other.m_ptr;
 		other.m_ptr = nullptr;
 	}
 
+	~SpotifyPtr()
+	{
+		Release();
+	}
+
+	SpotifyPtr & operator =(const SpotifyPtr & other)
+	{
+		*this = other.m_ptr;
+		return *this;
+	}
+
+	SpotifyPtr & operator =(SpotifyPtr && other) noexcept
+	{
+		if (this != &other)
+		{
+			Release();
+			m_ptr = other.m_ptr;
+			other.m_ptr = nullptr;
+		}
+		return *this;
+	}
+
 	void Release()
 	{
 		PtrType ptr = m_ptr;
 		m_ptr = nullptr;
-		if (ptr != null)
+		if (ptr != nullptr)
 		{
 			SpotifyRelease(ptr);
 		}
 	}
 
+	/** Takes over a reference returned by a create call. */
 	void Attach(PtrType ptr)
 	{
-		if (m_ptr != nullptr)
-		{
-			SpotifyRelease(ptr);
-		}
+		Release();
 		m_ptr = ptr;
 	}
 
@@ -262,12 +616,12 @@ public:
 
 	PtrType operator =(PtrType ptr)
 	{
-		Release();
-		m_ptr = ptr;
-		if (m_ptr != nullptr)
+		if (ptr != nullptr)
 		{
-			SpotifyAddRef(m_ptr);
+			SpotifyAddRef(ptr);
 		}
+		Release();
+		m_ptr = ptr;
 		return m_ptr;
 	}
 
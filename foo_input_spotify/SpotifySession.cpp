@@ -4,38 +4,93 @@
 
 #include <shlobj.h>
 
+#include <algorithm>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "SpotifySession.h"
 
+#include "art_prefetch.h"
 #include "cred_prompt.h"
+#include "config.h"
+#include "log_ring.h"
+#include "resolved_link.h"
 
 extern "C" {
 	extern const uint8_t g_appkey[];
 	extern const size_t g_appkey_size;
 }
 
+static const GUID guid_stored_username = { 0x8f3c2b71, 0x4d5e, 0x4a09, { 0xb6, 0x1d, 0x3e, 0x97, 0x20, 0xc4, 0x5a, 0x18 } };
+static const GUID guid_stored_credentials = { 0x21e4a9d6, 0x7b30, 0x4f8c, { 0x9e, 0x52, 0xd8, 0x0b, 0x6f, 0x13, 0xa7, 0xc4 } };
+
+/** From credentials_blob_updated: logs us in at startup without asking, and without libspotify keeping the password. */
+static cfg_string_mt cfg_stored_username(guid_stored_username, "");
+static cfg_string_mt cfg_stored_credentials(guid_stored_credentials, "");
+
+/** Milliseconds since foobar2000 started. */
+static LONG64 sinceProcessStart() {
+	FILETIME creation, exit, kernel, user, now;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return -1;
+	GetSystemTimeAsFileTime(&now);
+
+	ULARGE_INTEGER from, to;
+	from.LowPart = creation.dwLowDateTime;
+	from.HighPart = creation.dwHighDateTime;
+	to.LowPart = now.dwLowDateTime;
+	to.HighPart = now.dwHighDateTime;
+	return static_cast<LONG64>((to.QuadPart - from.QuadPart) / 10000);
+}
+
+static SpotifySession *volatile createdSession = NULL;
+
 SpotifySession & SpotifySession::instance()
 {
-	static SpotifySession session;
+	// Never destroyed: should the session thread not stop within the shutdown budget, it mustn't find the session gone.
+	static SpotifySession *session = new SpotifySession();
+
+	return *session;
+}
 
-	return session;
+SpotifySession *SpotifySession::ifCreated()
+{
+	return createdSession;
 }
 
 DWORD WINAPI spotifyThread(void *data) {
 	SpotifyThreadData *dat = (SpotifyThreadData*)data;
 
+	DECLARE_LOCK_SITE(site);
+	DWORD lastReport = GetTickCount();
+
 	int nextTimeout = INFINITE;
 	while (true) {
 		DWORD result = WaitForSingleObject(dat->processEventsEvent, nextTimeout);
 		switch (result) {
 		case WAIT_OBJECT_0:
+		case WAIT_TIMEOUT:
 		{
-			LockedCS lock(dat->cs);
+			LockedCS lock(dat->cs, site);
+			dat->session->runCommands();
+			dat->session->buf.retryMarkers();
 			sp_session_process_events(dat->sess, &nextTimeout);
+			if (dat->session->continueShutdown(nextTimeout))
+				return 0;
 		}
 		}
+
+		if ((cfg_log_lock_contention || cfg_log_buffer_stats) && GetTickCount() - lastReport > 60 * 1000) {
+			if (cfg_log_lock_contention)
+				LockSite::report();
+			if (cfg_log_buffer_stats) {
+				dat->session->buf.report();
+				dat->session->reportDecoder();
+				dat->session->imageCache.report();
+				dat->session->artistPortraits.report();
+			}
+			lastReport = GetTickCount();
+		}
 	}
 }
 
@@ -66,8 +121,14 @@ void alertIfFailure(pfc::string8 msg, sp_error err) {
 void CALLBACK log_message(sp_session *sess, const char *error);
 void CALLBACK message_to_user(sp_session *sess, const char *error);
 void CALLBACK start_playback(sp_session *sess);
+void CALLBACK stop_playback(sp_session *sess);
+void CALLBACK get_audio_buffer_stats(sp_session *sess, sp_audio_buffer_stats *stats);
 void CALLBACK logged_in(sp_session *sess, sp_error error);
+void CALLBACK logged_out(sp_session *sess);
+void CALLBACK connectionstate_updated(sp_session *sess);
+void CALLBACK credentials_blob_updated(sp_session *sess, const char *blob);
 void CALLBACK notify_main_thread(sp_session *sess);
+void CALLBACK metadata_updated(sp_session *sess);
 int CALLBACK music_delivery(sp_session *sess, const sp_audioformat *format, const void *frames, int num_frames);
 void CALLBACK end_of_track(sp_session *sess);
 void CALLBACK play_token_lost(sp_session *sess);
@@ -75,10 +136,16 @@ void CALLBACK play_token_lost(sp_session *sess);
 //BOOL CALLBACK makeSpotifySession(PINIT_ONCE initOnce, PVOID param, PVOID *context);
 
 SpotifySession::SpotifySession() :
-		threadData(spotifyCS), decoderOwner(NULL) {
+		threadData(spotifyCS), decoderOwner(NULL), lingeringDecoderOwner(NULL),
+		preemptedDecoderOwner(NULL), preemptedAt(0), preemptedFor(NULL), decoderOwnerPriority(DECODER_BACKGROUND), decoderOwnerSerial(0), decoderRequestSerial(0),
+		previousDecoderOwner(NULL),
+		decoderHandovers(0), decoderHandoverMs(0), decoderMaxHandoverMs(0),
+		loggedInEvent(TRUE, FALSE), loggingIn(false), loggingInWithBlob(false), loggedIn(false), loginWaitStartedAt(GetTickCount()), loggedInBefore(false),
+		lastReloginAt(0), reloginBackoffMs(0),
+		sessionThreadId(0), sessionThread(NULL), shutdownRequested(false), shutdownStarted(false), shutdownDeadline(0),
+		released(false), deferredReleases(nullptr) {
 
 	processEventsEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-	loggingIn = false;
 
 	static sp_session_callbacks session_callbacks = {};
 	static sp_session_config spconfig = {};
@@ -87,6 +154,9 @@ SpotifySession::SpotifySession() :
 	if (SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &path))
 		throw pfc::exception("couldn't get local app data path");
 
+	cacheDirectory = path;
+	cacheDirectory += L"\\foo_input_spotify";
+
 	size_t num;
 	char lpath[MAX_PATH];
 	if (wcstombs_s(&num, lpath, MAX_PATH, path, MAX_PATH)) {
@@ -108,35 +178,117 @@ SpotifySession::SpotifySession() :
 	spconfig.callbacks = &session_callbacks;
 
 	session_callbacks.logged_in = &logged_in;
+	session_callbacks.logged_out = &logged_out;
+	session_callbacks.connectionstate_updated = &connectionstate_updated;
+	session_callbacks.credentials_blob_updated = &credentials_blob_updated;
 	session_callbacks.notify_main_thread = &notify_main_thread;
+	session_callbacks.metadata_updated = &metadata_updated;
 	session_callbacks.music_delivery = &music_delivery;
 	session_callbacks.play_token_lost = &play_token_lost;
 	session_callbacks.end_of_track = &end_of_track;
 	session_callbacks.log_message = &log_message;
 	session_callbacks.message_to_user = &message_to_user;
 	session_callbacks.start_playback = &start_playback;
+	session_callbacks.stop_playback = &stop_playback;
+	session_callbacks.get_audio_buffer_stats = &get_audio_buffer_stats;
 
 	{
-		LockedCS lock(spotifyCS);
+		DECLARE_LOCK_SITE(site);
+		LockedCS lock(spotifyCS, site);
 
 		assertSucceeds("creating session", sp_session_create(&spconfig, &sp));
 	}
 
+	CreateDirectoryW(cacheDirectory.c_str(), NULL);
+	metadataCache.open(cacheDirectory);
+	imageCache.open(cacheDirectory);
+
+	// Once the decoder has drained the buffer, the session thread gets libspotify to deliver again.
+	buf.setRefillEvent(processEventsEvent);
+
 	threadData.processEventsEvent = processEventsEvent;
 	threadData.sess = sp;
+	threadData.session = this;
 
 	SetLastError(ERROR_SUCCESS);
-	const HANDLE thread = CreateThread(NULL, 0, &spotifyThread, &threadData, 0, NULL);
-	if (NULL == thread) {
+	sessionThread = CreateThread(NULL, 0, &spotifyThread, &threadData, 0, &sessionThreadId);
+	if (NULL == sessionThread) {
 		throw win32exception("Couldn't create thread");
 	}
-	CloseHandle(thread);
+
+	createdSession = this;
 }
 
 SpotifySession::~SpotifySession() {
+	if (sessionThread != NULL)
+		CloseHandle(sessionThread);
 	CloseHandle(processEventsEvent);
 }
 
+void SpotifySession::shutdown(DWORD budgetMs) {
+	const DWORD startedAt = GetTickCount();
+	// Leave a little of the budget for the session thread to release the session once it's given up on logging out.
+	shutdownDeadline = startedAt + budgetMs * 3 / 4;
+	if (shutdownRequested.exchange(true))
+		return;
+	processEvents();
+
+	if (WAIT_OBJECT_0 == WaitForSingleObject(sessionThread, budgetMs))
+		LogFormatter(LOG_SESSION) << "shut down in " << (GetTickCount() - startedAt) << " ms";
+	else
+		LogFormatter(LOG_SESSION, LOG_WARNING) << "didn't shut down within " << budgetMs << " ms";
+}
+
+bool SpotifySession::continueShutdown(int &nextTimeout) {
+	if (!shutdownRequested.load())
+		return false;
+
+	if (!shutdownStarted) {
+		shutdownStarted = true;
+
+		// Let go of everything still referenced, so it's all gone before the session is.
+		while (!resolvedLinks.empty())
+			eraseResolvedLink(resolvedLinks.begin());
+		runCommands();
+
+		sp_session_player_unload(sp);
+		sp_session_flush_caches(sp);
+
+		switch (sp_session_connectionstate(sp)) {
+		case SP_CONNECTION_STATE_LOGGED_IN:
+		case SP_CONNECTION_STATE_OFFLINE:
+		case SP_CONNECTION_STATE_DISCONNECTED:
+			sp_session_logout(sp);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Logging out writes libspotify's settings and cache index, which is what makes the next start quick.
+	if (SP_CONNECTION_STATE_LOGGED_OUT != sp_session_connectionstate(sp)
+			&& static_cast<LONG>(shutdownDeadline - GetTickCount()) > 0) {
+		if (nextTimeout < 0 || nextTimeout > 20)
+			nextTimeout = 20;
+		return false;
+	}
+
+	// Anything queued before now still runs against the session; anything after is refused (see enqueue, deferRelease).
+	{
+		LockedCS lock(commandsCS);
+		released.store(true);
+	}
+	runCommands();
+
+	sp_session_release(sp);
+	sp = NULL;
+	return true;
+}
+
+bool SpotifySession::isReleased() const {
+	return released.load();
+}
+
 sp_session *SpotifySession::getAnyway() {
 	return sp;
 }
@@ -157,6 +309,10 @@ CriticalSection &SpotifySession::getSpotifyCS() {
 	return spotifyCS;
 }
 
+const std::wstring &SpotifySession::getCacheDirectory() {
+	return cacheDirectory;
+}
+
 class main_thread_callback_spotify_login : public main_thread_callback {
 private:
 	sp_session * const session;
@@ -184,7 +340,8 @@ public:
 			*loggingIn = false;
 		}
 		else {
-			LockedCS lock(SpotifySession::instance().getSpotifyCS());
+			DECLARE_LOCK_SITE(site);
+			LockedCS lock(SpotifySession::instance().getSpotifyCS(), site);
 			sp_error loginResult = sp_session_login(session, cpr->un.data(), cpr->pw.data(), /*remember_me*/ false, /*blob*/ nullptr);
 		}
 	}
@@ -198,7 +355,8 @@ void SpotifySession::showLoginUI(sp_error last_login_result) {
 }
 
 void SpotifySession::requireLoggedIn() {
-	LockedCS lock(getSpotifyCS());
+	DECLARE_LOCK_SITE(site);
+	LockedCS lock(getSpotifyCS(), site);
 
 	sp_session * session = getAnyway();
 
@@ -212,12 +370,19 @@ void SpotifySession::requireLoggedIn() {
 	case SP_CONNECTION_STATE_UNDEFINED:
 	case SP_CONNECTION_STATE_DISCONNECTED:
 	{
+		// Everyone opening something comes through here; don't hammer the servers while it isn't working out.
+		const DWORD now = GetTickCount();
+		if (now - lastReloginAt < reloginBackoffMs)
+			break;
+		lastReloginAt = now;
+		reloginBackoffMs = pfc::min_t(pfc::max_t(reloginBackoffMs * 2, MIN_RELOGIN_BACKOFF_MS), MAX_RELOGIN_BACKOFF_MS);
+
 		sp_error reloginResult = sp_session_relogin(session);
 		switch (reloginResult) {
 		case SP_ERROR_OK:
 			break;
 		case SP_ERROR_NO_CREDENTIALS:
-			if (!loggingIn) {
+			if (!loggingIn && !loginWithStoredCredentials()) {
 				showLoginUI();
 			}
 			break;
@@ -228,55 +393,491 @@ void SpotifySession::requireLoggedIn() {
 	}
 }
 
-void SpotifySession::waitForLogin(abort_callback & p_abort) {
+/** With the spotify lock held. @return whether a login is under way. */
+bool SpotifySession::loginWithStoredCredentials() {
+	pfc::string8 username, blob;
+	cfg_stored_username.get(username);
+	cfg_stored_credentials.get(blob);
+	if (username.is_empty() || blob.is_empty())
+		return false;
+
+	if (SP_ERROR_OK != sp_session_login(sp, username, /*password*/ nullptr, /*remember_me*/ false, blob))
+		return false;
+
 	LockedCS lock(loginCS);
-	while (!loggedIn) {
-		loginCondVar.sleep(loginCS, 100);
-		p_abort.check();
+	loggingInWithBlob = true;
+	return true;
+}
+
+void SpotifySession::warmUp() {
+	DECLARE_LOCK_SITE(site);
+	LockedCS lock(spotifyCS, site);
+
+	switch (sp_session_connectionstate(sp)) {
+	case SP_CONNECTION_STATE_LOGGED_OUT:
+	case SP_CONNECTION_STATE_UNDEFINED:
+		if (SP_ERROR_NO_CREDENTIALS == sp_session_relogin(sp))
+			loginWithStoredCredentials();
+		break;
+	default:
+		break;
+	}
+}
+
+/** Called on the session thread, with the spotify lock held. */
+void SpotifySession::onCredentialsBlobUpdated(const char *blob) {
+	cfg_stored_username.set(sp_session_user_name(sp));
+	cfg_stored_credentials.set(blob);
+}
+
+void SpotifySession::waitForLogin(abort_callback & p_abort) {
+	// Woken as soon as we're logged in; the timeout is only for retrying a relogin that didn't work out.
+	while (!loggedInEvent.wait(p_abort, reloginBackoffMs + MIN_RELOGIN_BACKOFF_MS))
+		requireLoggedIn();
+}
+
+bool SpotifySession::isLoggedIn() {
+	return WAIT_OBJECT_0 == WaitForSingleObject(loggedInEvent.handle, 0);
+}
+
+/** Requires loginCS. */
+void SpotifySession::setLoggedIn(bool in) {
+	if (in == loggedIn)
+		return;
+	loggedIn = in;
+
+	if (in) {
+		LogFormatter(LOG_SESSION) << "logged in after " << (GetTickCount() - loginWaitStartedAt) << " ms";
+		if (!loggedInBefore) {
+			loggedInBefore = true;
+			LogFormatter(LOG_SESSION) << "first logged in " << sinceProcessStart() << " ms after foobar2000 started";
+		}
+		SetEvent(loggedInEvent.handle);
+	}
+	else {
+		loginWaitStartedAt = GetTickCount();
+		ResetEvent(loggedInEvent.handle);
 	}
 }
 
+/** Called on the session thread, with the spotify lock held. */
 void SpotifySession::onLoggedIn(sp_error err) {
 	LockedCS lock(loginCS);
 
+	const bool withBlob = loggingInWithBlob;
+	loggingInWithBlob = false;
+
 	if (SP_ERROR_OK == err) {
 		loggingIn = false;
-		loggedIn = true;
+		reloginBackoffMs = 0;
+		setLoggedIn(true);
+		return;
 	}
-	else {
-		loggedIn = false;
-		if (loggingIn) {
-			showLoginUI(err);
+
+	setLoggedIn(false);
+	if (withBlob) {
+		switch (err) {
+		case SP_ERROR_BAD_USERNAME_OR_PASSWORD:
+		case SP_ERROR_USER_BANNED:
+		case SP_ERROR_USER_NEEDS_PREMIUM:
+			// The blob was rejected, and would be forever; ask for the password instead, now and on later relogins.
+			cfg_stored_credentials.set("");
+			if (!loggingIn)
+				showLoginUI(err);
+			break;
+		default:
+			// Most likely the network; relogins try the blob again.
+			break;
 		}
 	}
-
-	loginCondVar.wakeAll();
+	else if (loggingIn) {
+		showLoginUI(err);
+	}
 }
 
 void SpotifySession::onLoggedOut() {
 	LockedCS lock(loginCS);
+	setLoggedIn(false);
+}
+
+/** Called on the session thread, with the spotify lock held. Catches libspotify dropping and regaining the connection by itself. */
+void SpotifySession::onConnectionStateUpdated() {
+	const sp_connectionstate state = sp_session_connectionstate(sp);
+
+	LockedCS lock(loginCS);
+	switch (state) {
+	case SP_CONNECTION_STATE_LOGGED_IN:
+	case SP_CONNECTION_STATE_OFFLINE:
+		reloginBackoffMs = 0;
+		setLoggedIn(true);
+		break;
+	default:
+		setLoggedIn(false);
+		break;
+	}
+}
+
+/** Requires the spotify lock. @return whether the request is finished, successfully or not. */
+bool SpotifySession::checkTrackLoadRequest(TrackLoadRequest &request) {
+	size_t stillLoading = 0;
+	for (size_t i = 0; i < request.pending.size(); ++i) {
+		const sp_error e = sp_track_error(request.pending[i]);
+		if (SP_ERROR_IS_LOADING == e)
+			request.pending[stillLoading++] = request.pending[i];
+		else if (SP_ERROR_OK != e)
+			request.error = e;
+	}
+	request.pending.resize(stillLoading);
+
+	return request.pending.empty() || request.error != SP_ERROR_OK;
+}
+
+void SpotifySession::awaitTracksLoaded(LockedCS &lock, const std::vector<sp_track *> &tracks, abort_callback &p_abort) {
+	Event ev(FALSE, FALSE);
+
+	TrackLoadRequest request;
+	request.pending = tracks;
+	request.error = SP_ERROR_OK;
+	request.done = ev.handle;
+
+	if (!checkTrackLoadRequest(request)) {
+		trackLoadRequests.push_back(&request);
+		try {
+			while (!request.pending.empty() && SP_ERROR_OK == request.error) {
+				// The timeout is only a safety net in case an update slips past us.
+				if (!lock.waitForEvent(ev, p_abort, 1000))
+					checkTrackLoadRequest(request);
+			}
+		}
+		catch (...) {
+			trackLoadRequests.erase(std::remove(trackLoadRequests.begin(), trackLoadRequests.end(), &request), trackLoadRequests.end());
+			throw;
+		}
+		trackLoadRequests.erase(std::remove(trackLoadRequests.begin(), trackLoadRequests.end(), &request), trackLoadRequests.end());
+	}
+
+	assertSucceeds("loading track", request.error);
+}
+
+void SpotifySession::awaitTracksLoaded(const std::vector<sp_track *> &tracks, abort_callback &p_abort) {
+	Event ev(FALSE, FALSE);
+
+	TrackLoadRequest request;
+	request.pending = tracks;
+	request.error = SP_ERROR_OK;
+	request.done = ev.handle;
+
+	// The request is only ever looked at on the session thread; this one just waits for it to be signalled.
+	const auto check = [&request](sp_session *) {
+		return checkTrackLoadRequest(request);
+	};
+	const auto forget = [this, &request](sp_session *) {
+		trackLoadRequests.erase(std::remove(trackLoadRequests.begin(), trackLoadRequests.end(), &request), trackLoadRequests.end());
+	};
+
+	const bool done = call([this, &request](sp_session *) {
+		if (checkTrackLoadRequest(request))
+			return true;
+		trackLoadRequests.push_back(&request);
+		return false;
+	}, p_abort);
+
+	if (!done) {
+		abort_callback_dummy noAbort;
+		try {
+			// The timeout is only a safety net in case an update slips past us.
+			while (!call(check, p_abort))
+				ev.wait(p_abort, 1000);
+		}
+		catch (...) {
+			call(forget, noAbort);
+			throw;
+		}
+		call(forget, noAbort);
+	}
+
+	assertSucceeds("loading track", request.error);
+}
+
+/** Called on the session thread, with the spotify lock held. */
+void SpotifySession::onMetadataUpdated() {
+	for (std::vector<TrackLoadRequest *>::iterator it = trackLoadRequests.begin(); it != trackLoadRequests.end(); ++it) {
+		if (checkTrackLoadRequest(**it))
+			SetEvent((*it)->done);
+	}
+
+	LockedCS lock(metadataCS);
+
+	for (std::vector<HANDLE>::iterator it = metadataWaiters.begin(); it != metadataWaiters.end(); ++it)
+		SetEvent(*it);
+}
+
+void SP_CALLCONV playlist_tracks_added(sp_playlist *pl, sp_track * const *tracks, int num_tracks, int position, void *userdata) {
+	static_cast<SpotifySession *>(userdata)->onPlaylistChanged(pl);
+}
+
+void SP_CALLCONV playlist_tracks_removed(sp_playlist *pl, const int *tracks, int num_tracks, void *userdata) {
+	static_cast<SpotifySession *>(userdata)->onPlaylistChanged(pl);
+}
+
+void SP_CALLCONV playlist_tracks_moved(sp_playlist *pl, const int *tracks, int num_tracks, int new_position, void *userdata) {
+	static_cast<SpotifySession *>(userdata)->onPlaylistChanged(pl);
+}
 
-	loggedIn = false;
+static sp_playlist_callbacks resolvedLinkCallbacks = { &playlist_tracks_added, &playlist_tracks_removed, &playlist_tracks_moved };
 
-	loginCondVar.wakeAll();
+std::shared_ptr<ResolvedLink> SpotifySession::findResolvedLink(const std::string &uri) {
+	std::map<std::string, ResolvedLinkEntry>::iterator it = resolvedLinks.find(uri);
+	if (it == resolvedLinks.end())
+		return std::shared_ptr<ResolvedLink>();
+
+	ResolvedLinkEntry &entry = it->second;
+	const DWORD now = GetTickCount();
+	if (entry.stale || (entry.watched == NULL && now - entry.storedAt > cfg_link_cache_minutes.get() * 60 * 1000)) {
+		eraseResolvedLink(it);
+		return std::shared_ptr<ResolvedLink>();
+	}
+
+	entry.lastUsed = now;
+	return entry.link;
+}
+
+void SpotifySession::storeResolvedLink(const std::string &uri, const std::shared_ptr<ResolvedLink> &link, sp_playlist *watch) {
+	if (cfg_link_cache_minutes.get() == 0)
+		return;
+
+	std::map<std::string, ResolvedLinkEntry>::iterator it = resolvedLinks.find(uri);
+	if (it != resolvedLinks.end())
+		eraseResolvedLink(it);
+
+	const DWORD now = GetTickCount();
+	if (resolvedLinks.size() >= MAX_RESOLVED_LINKS) {
+		std::map<std::string, ResolvedLinkEntry>::iterator oldest = resolvedLinks.begin();
+		for (it = resolvedLinks.begin(); it != resolvedLinks.end(); ++it) {
+			if (now - it->second.lastUsed > now - oldest->second.lastUsed)
+				oldest = it;
+		}
+		eraseResolvedLink(oldest);
+	}
+
+	ResolvedLinkEntry entry;
+	entry.link = link;
+	entry.watched = watch;
+	entry.storedAt = entry.lastUsed = now;
+	entry.stale = false;
+	if (watch != NULL)
+		sp_playlist_add_callbacks(watch, &resolvedLinkCallbacks, this);
+	resolvedLinks[uri] = entry;
+}
+
+void SpotifySession::eraseResolvedLink(std::map<std::string, ResolvedLinkEntry>::iterator it) {
+	if (it->second.watched != NULL)
+		sp_playlist_remove_callbacks(it->second.watched, &resolvedLinkCallbacks, this);
+	// Anyone still using the link keeps their copy.
+	resolvedLinks.erase(it);
+}
+
+/** Called on the session thread, with the spotify lock held. Entries are only marked here;
+ * they're dropped on the next lookup, rather than removing callbacks from inside one. */
+void SpotifySession::onPlaylistChanged(sp_playlist *pl) {
+	for (std::map<std::string, ResolvedLinkEntry>::iterator it = resolvedLinks.begin(); it != resolvedLinks.end(); ++it) {
+		if (it->second.watched == pl)
+			it->second.stale = true;
+	}
+}
+
+void SpotifySession::addMetadataWaiter(Event &ev) {
+	LockedCS lock(metadataCS);
+	metadataWaiters.push_back(ev.handle);
+}
+
+void SpotifySession::removeMetadataWaiter(Event &ev) {
+	LockedCS lock(metadataCS);
+	metadataWaiters.erase(std::remove(metadataWaiters.begin(), metadataWaiters.end(), ev.handle), metadataWaiters.end());
 }
 
 void SpotifySession::processEvents() {
 	SetEvent(processEventsEvent);
 }
 
+void SpotifySession::enqueue(SpotifyCommand &command, abort_callback &p_abort) {
+	{
+		LockedCS lock(commandsCS);
+		if (released.load())
+			throw exception_io_data("spotify session has been shut down");
+		commands.push_back(&command);
+	}
+	processEvents();
+
+	try {
+		command.done.wait(p_abort);
+	}
+	catch (exception_aborted &) {
+		{
+			LockedCS lock(commandsCS);
+			std::vector<SpotifyCommand *>::iterator it = std::find(commands.begin(), commands.end(), &command);
+			if (it != commands.end()) {
+				commands.erase(it);
+				throw;
+			}
+		}
+
+		// The session thread has already picked it up, and still refers to it.
+		WaitForSingleObject(command.done.handle, INFINITE);
+		throw;
+	}
+}
+
+void SpotifySession::deferRelease(void (*release)(void *ptr), void *ptr) {
+	// The session took everything it handed out with it.
+	if (released.load())
+		return;
+
+	SpotifyDeferredRelease *node = new SpotifyDeferredRelease;
+	node->release = release;
+	node->ptr = ptr;
+	node->next = deferredReleases.load(std::memory_order_relaxed);
+	while (!deferredReleases.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+	processEvents();
+}
+
+void SpotifySession::runCommands() {
+	// Only this thread ever takes from the stack, and it takes everything, so there's no ABA.
+	SpotifyDeferredRelease *node = deferredReleases.exchange(nullptr, std::memory_order_acquire);
+	while (node != nullptr) {
+		SpotifyDeferredRelease *next = node->next;
+		node->release(node->ptr);
+		delete node;
+		node = next;
+	}
+
+	std::vector<SpotifyCommand *> pending;
+	{
+		LockedCS lock(commandsCS);
+		pending.swap(commands);
+	}
+
+	for (std::vector<SpotifyCommand *>::iterator it = pending.begin(); it != pending.end(); ++it) {
+		SpotifyCommand &command = **it;
+		command.run(sp);
+		// The caller may be gone as soon as this is set.
+		SetEvent(command.done.handle);
+	}
+}
+
 bool SpotifySession::hasDecoder(void *owner) {
 	return decoderOwner == owner;
 }
 
-void SpotifySession::takeDecoder(void *owner) {
-	if (!hasDecoder(NULL))
-		throw exception_io_data("Someone else is already decoding");
- 
-	InterlockedCompareExchangePointer(&decoderOwner, owner, NULL);
+/** Whether a request may take the player from its owner.
+ * Playback and previews supersede older ones: those are on their way out, e.g. when skipping quickly. */
+static bool outranks(const DecoderRequest &request, DecoderPriority ownerPriority, t_uint64 ownerSerial) {
+	if (request.priority != ownerPriority)
+		return request.priority > ownerPriority;
+	return request.priority != DECODER_BACKGROUND && request.serial > ownerSerial;
+}
 
-	if (!hasDecoder(owner))
-		throw exception_io_data("Someone else beat us to the decoder");
+void SpotifySession::wakeDecoderWaiters() {
+	for (std::deque<DecoderRequest>::const_iterator it = decoderQueue.begin(); it != decoderQueue.end(); ++it)
+		SetEvent(it->wake);
+}
+
+bool SpotifySession::takeDecoder(void *owner, DecoderPriority priority, abort_callback &p_abort, bool resuming) {
+	LockedCS lock(decoderCS);
+
+	if (hasDecoder(owner)) {
+		// Moving on to another subsong of the same input.
+		InterlockedCompareExchangePointer(&lingeringDecoderOwner, NULL, owner);
+		return false;
+	}
+
+	// Higher priorities go first. Among equals, background decoders wait their turn (unless resuming),
+	// while the newest playback or preview goes first, as the older ones have been given up on.
+	const bool first = resuming || priority != DECODER_BACKGROUND;
+	std::deque<DecoderRequest>::iterator pos = decoderQueue.begin();
+	while (pos != decoderQueue.end() && (pos->priority > priority || (pos->priority == priority && !first)))
+		++pos;
+	Event wake(FALSE, FALSE);
+	DecoderRequest request = { owner, priority, ++decoderRequestSerial, wake.handle };
+	decoderQueue.insert(pos, request);
+
+	const DWORD requestedAt = GetTickCount();
+	try {
+		while (true) {
+			DWORD timeout = INFINITE;
+			if (decoderQueue.front().owner == owner) {
+				PVOID current = decoderOwner;
+				// An owner that finished its subsong but kept the player for the next one gives way to anyone else.
+				if (current == NULL || current == lingeringDecoderOwner)
+					break;
+
+				if (outranks(request, decoderOwnerPriority, decoderOwnerSerial)) {
+					// Someone ahead of us may have asked it already; their grace period carries on for us.
+					if (preemptedDecoderOwner != current) {
+						InterlockedExchangePointer(&preemptedDecoderOwner, current);
+						preemptedAt = GetTickCount();
+						// Get it out of a blocking read, to notice.
+						buf.interrupt();
+					}
+					preemptedFor = owner;
+
+					// It isn't decoding, or it would have noticed by now: most likely it's being torn down.
+					const DWORD sinceAsked = GetTickCount() - preemptedAt;
+					if (sinceAsked >= DECODER_HANDOVER_TIMEOUT_MS)
+						break;
+					timeout = DECODER_HANDOVER_TIMEOUT_MS - sinceAsked;
+				}
+			}
+
+			UnlockedCS unlocked(lock);
+			wake.wait(p_abort, timeout);
+		}
+	}
+	catch (...) {
+		for (pos = decoderQueue.begin(); pos != decoderQueue.end(); ++pos) {
+			if (pos->owner == owner) {
+				decoderQueue.erase(pos);
+				break;
+			}
+		}
+		// Withdraw our request to the owner, unless whoever's first now would make it too; they keep its grace period.
+		if (preemptedFor == owner) {
+			if (!decoderQueue.empty() && outranks(decoderQueue.front(), decoderOwnerPriority, decoderOwnerSerial))
+				preemptedFor = decoderQueue.front().owner;
+			else
+				InterlockedCompareExchangePointer(&preemptedDecoderOwner, NULL, decoderOwner);
+		}
+		wakeDecoderWaiters();
+		throw;
+	}
+
+	decoderQueue.pop_front();
+
+	const bool handedOver = previousDecoderOwner != NULL && previousDecoderOwner != owner;
+	InterlockedExchangePointer(&lingeringDecoderOwner, NULL);
+	InterlockedExchangePointer(&decoderOwner, owner);
+	decoderOwnerPriority = priority;
+	decoderOwnerSerial = request.serial;
+	previousDecoderOwner = owner;
+
+	const LONG64 waited = GetTickCount() - requestedAt;
+	InterlockedIncrement64(&decoderHandovers);
+	InterlockedExchangeAdd64(&decoderHandoverMs, waited);
+	if (waited > decoderMaxHandoverMs)
+		InterlockedExchange64(&decoderMaxHandoverMs, waited);
+
+	wakeDecoderWaiters();
+	return handedOver;
+}
+
+bool SpotifySession::isPreempted(void *owner) {
+	return preemptedDecoderOwner == owner || !hasDecoder(owner);
+}
+
+bool SpotifySession::yieldDecoder(void *owner, DecoderPriority priority, abort_callback &p_abort) {
+	releaseDecoder(owner);
+	return takeDecoder(owner, priority, p_abort, true);
 }
 
 void SpotifySession::ensureDecoder(void *owner) {
@@ -285,7 +886,31 @@ void SpotifySession::ensureDecoder(void *owner) {
 }
 
 void SpotifySession::releaseDecoder(void *owner) {
+	LockedCS lock(decoderCS);
+
+	InterlockedCompareExchangePointer(&lingeringDecoderOwner, NULL, owner);
+	InterlockedCompareExchangePointer(&preemptedDecoderOwner, NULL, owner);
 	InterlockedCompareExchangePointer(&decoderOwner, NULL, owner);
+
+	wakeDecoderWaiters();
+}
+
+/** Keeps the decoder, but lets anyone else who asks for it take it over. */
+void SpotifySession::lingerDecoder(void *owner) {
+	LockedCS lock(decoderCS);
+
+	if (hasDecoder(owner)) {
+		InterlockedExchangePointer(&lingeringDecoderOwner, owner);
+		wakeDecoderWaiters();
+	}
+}
+
+void SpotifySession::reportDecoder() {
+	if (0 == decoderHandovers)
+		return;
+	console::formatter() << "spotify player: taken " << decoderHandovers << " times"
+		<< ", waited " << decoderHandoverMs / decoderHandovers << " ms on average"
+		<< " (max " << decoderMaxHandoverMs << " ms)";
 }
 
 /** sp_session_userdata is assumed to be thread safe. */
@@ -293,8 +918,9 @@ SpotifySession *from(sp_session *sess) {
 	return static_cast<SpotifySession *>(sp_session_userdata(sess));
 }
 
+/** Called with the spotify lock held, often; mustn't wait for the console. */
 void SP_CALLCONV log_message(sp_session *sess, const char *error) {
-	console::formatter() << "spotify log: " << error;
+	LogRing::instance().write(LOG_LIBSPOTIFY, LOG_INFO, error);
 }
 
 void SP_CALLCONV message_to_user(sp_session *sess, const char *message) {
@@ -302,7 +928,16 @@ void SP_CALLCONV message_to_user(sp_session *sess, const char *message) {
 }
 
 void SP_CALLCONV start_playback(sp_session *sess) {
-	return;
+	from(sess)->buf.startDelivery();
+}
+
+void SP_CALLCONV stop_playback(sp_session *sess) {
+	from(sess)->buf.stopDelivery();
+}
+
+void SP_CALLCONV get_audio_buffer_stats(sp_session *sess, sp_audio_buffer_stats *stats) {
+	stats->samples = from(sess)->buf.bufferedFrames();
+	stats->stutter = from(sess)->buf.takeStutters();
 }
 
 void SP_CALLCONV logged_in(sp_session *sess, sp_error error)
@@ -315,39 +950,105 @@ void SP_CALLCONV logged_out(sp_session *sess)
 	from(sess)->onLoggedOut();
 }
 
+void SP_CALLCONV connectionstate_updated(sp_session *sess)
+{
+	from(sess)->onConnectionStateUpdated();
+}
+
+void SP_CALLCONV credentials_blob_updated(sp_session *sess, const char *blob)
+{
+	from(sess)->onCredentialsBlobUpdated(blob);
+}
+
 void SP_CALLCONV notify_main_thread(sp_session *sess)
 {
     from(sess)->processEvents();
 }
 
+void SP_CALLCONV metadata_updated(sp_session *sess)
+{
+	from(sess)->onMetadataUpdated();
+}
+
 int SP_CALLCONV music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
 	if (num_frames == 0) {
-		from(sess)->buf.flush();
+		if (!from(sess)->buf.flushFromProducer())
+			LogFormatter(LOG_PLAYBACK, LOG_WARNING) << "buffer markers full, flush deferred";
         return 0;
 	}
 
-	if (from(sess)->buf.isFull()) {
-		return 0;
-	}
+	const size_t frameSize = sizeof(int16_t) * format->channels;
 
-	const size_t s = num_frames * sizeof(int16_t) * format->channels;
+	const size_t written = from(sess)->buf.write(frames, num_frames * frameSize, format->sample_rate, format->channels);
 
-	void *data = new char[s];
-	memcpy(data, frames, s);
-
-	from(sess)->buf.add(data, s, format->sample_rate, format->channels);
-
-	return num_frames;
+	return static_cast<int>(written / frameSize);
 }
 
 void SP_CALLCONV end_of_track(sp_session *sess)
 {
-	from(sess)->buf.add(NULL, 0, 0, 0);
+	if (!from(sess)->buf.endOfTrack())
+		LogFormatter(LOG_PLAYBACK, LOG_WARNING) << "buffer markers full, end of track deferred";
 }
 
 void SP_CALLCONV play_token_lost(sp_session *sess)
 {
 	alert("play token lost (someone's using your account elsewhere)");
 }
+
+/** Creating the session while it's being shut down would race with static destruction; on_quit waits for this. */
+static HANDLE warmUpThreadHandle = NULL;
+
+DWORD WINAPI warmUpThread(void *) {
+	try {
+		SpotifySession::instance().warmUp();
+	}
+	catch (std::exception &e) {
+		LogFormatter(LOG_SESSION, LOG_ERROR) << "couldn't start the session: " << e.what();
+	}
+	return 0;
+}
+
+class initquit_spotify : public initquit {
+public:
+	virtual void on_init() {
+		// Creating the session and logging in take a while; have that done by the time anything's opened.
+		warmUpThreadHandle = CreateThread(NULL, 0, &warmUpThread, NULL, 0, NULL);
+
+		ArtPrefetcher::instance().start();
+	}
+
+	virtual void on_quit() {
+		// Everything below shares the one budget, so quitting never takes longer than it says.
+		const DWORD deadline = GetTickCount() + static_cast<DWORD>(cfg_shutdown_ms.get());
+
+		// It uses the session; stop it first.
+		ArtPrefetcher::instance().shutdown();
+
+		// Until it's done, the session may be half created, and ifCreated() not know about it yet.
+		if (warmUpThreadHandle != NULL) {
+			if (WAIT_OBJECT_0 == WaitForSingleObject(warmUpThreadHandle, remainingUntil(deadline))) {
+				CloseHandle(warmUpThreadHandle);
+				warmUpThreadHandle = NULL;
+			}
+			else {
+				LogFormatter(LOG_SESSION, LOG_WARNING) << "still starting the session; not waiting for it";
+			}
+		}
+
+		SpotifySession *session = SpotifySession::ifCreated();
+		if (session != NULL)
+			session->shutdown(remainingUntil(deadline));
+		LogRing::instance().shutdown(remainingUntil(deadline));
+	}
+
+private:
+	static DWORD remainingUntil(DWORD deadline) {
+		const DWORD now = GetTickCount();
+		// Compared as a difference, so it's right across GetTickCount() wrapping.
+		return static_cast<LONG>(deadline - now) > 0 ? deadline - now : 0;
+	}
+};
+
+static initquit_factory_t<initquit_spotify> initquitSpotify;
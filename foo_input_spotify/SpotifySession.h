@@ -1,7 +1,29 @@
 #pragma once
 
 #include "util.h"
+#include "artist_portraits.h"
+#include "image_cache.h"
+#include "metadata_cache.h"
 #include <libspotify/api.h>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SpotifySession;
+struct ResolvedLink;
+
+/** An entry of the session's resolved-link cache. */
+struct ResolvedLinkEntry {
+	std::shared_ptr<ResolvedLink> link;
+	/** For playlists: changes to it make the entry stale, and it doesn't expire by age. Otherwise NULL. */
+	sp_playlist *watched;
+	DWORD storedAt;
+	DWORD lastUsed;
+	bool stale;
+};
 
 struct SpotifyThreadData {
 	SpotifyThreadData(CriticalSection &cs) : cs(cs) {
@@ -10,6 +32,65 @@ struct SpotifyThreadData {
 	HANDLE processEventsEvent;
 	CriticalSection &cs;
 	sp_session *sess;
+	SpotifySession *session;
+};
+
+/** Work queued for the session thread; see SpotifySession::call(). */
+struct SpotifyCommand : boost::noncopyable {
+	Event done;
+
+	SpotifyCommand() : done(FALSE, FALSE) {
+	}
+
+	virtual ~SpotifyCommand() {
+	}
+
+	virtual void run(sp_session *sess) = 0;
+};
+
+/** A libspotify release that couldn't take the spotify lock straight away, left for the session thread. */
+struct SpotifyDeferredRelease {
+	void (*release)(void *ptr);
+	void *ptr;
+	SpotifyDeferredRelease *next;
+};
+
+template <typename R>
+struct SpotifyTaskCommand : SpotifyCommand {
+	std::packaged_task<R(sp_session *)> task;
+
+	template <typename F>
+	SpotifyTaskCommand(F f) : task(f) {
+	}
+
+	virtual void run(sp_session *sess) {
+		task(sess);
+	}
+};
+
+/** Who gets the single libspotify player first; see SpotifySession::takeDecoder(). */
+enum DecoderPriority {
+	/** Converters, ReplayGain scans... */
+	DECODER_BACKGROUND,
+	/** Decoding for something other than playback that may seek around. */
+	DECODER_PREVIEW,
+	DECODER_PLAYBACK,
+};
+
+struct DecoderRequest {
+	void *owner;
+	DecoderPriority priority;
+	/** Order of the requests; among playbacks and previews, the newest wins. */
+	t_uint64 serial;
+	/** Signalled whenever the owner or the queue changes. */
+	HANDLE wake;
+};
+
+/** A set of tracks someone is waiting on; see SpotifySession::awaitTracksLoaded(). */
+struct TrackLoadRequest {
+	std::vector<sp_track *> pending;
+	sp_error error;
+	HANDLE done;
 };
 
 #if defined(_MSC_VER)
@@ -28,18 +109,89 @@ class SpotifySession {
 	CriticalSection spotifyCS;
 	HANDLE processEventsEvent;
 	POINTER_ALIGN volatile PVOID decoderOwner;
+	POINTER_ALIGN volatile PVOID lingeringDecoderOwner;
+	/** An owner that has been asked to give way. */
+	POINTER_ALIGN volatile PVOID preemptedDecoderOwner;
+	/** Changes to the decoder owner happen under decoderCS; reading it needn't. */
+	CriticalSection decoderCS;
+	/** When preemptedDecoderOwner was asked, for whoever ends up waiting on it. Guarded by decoderCS. */
+	DWORD preemptedAt;
+	/** The waiter on whose behalf preemptedDecoderOwner was asked; only it withdraws the request. Guarded by decoderCS. */
+	void *preemptedFor;
+	/** Guarded by decoderCS. */
+	DecoderPriority decoderOwnerPriority;
+	t_uint64 decoderOwnerSerial;
+	t_uint64 decoderRequestSerial;
+	/** The last owner, whose track may still be loaded. Guarded by decoderCS. */
+	void *previousDecoderOwner;
+	/** Those waiting for the player, in the order they're served. Guarded by decoderCS. */
+	std::deque<DecoderRequest> decoderQueue;
+	volatile LONG64 decoderHandovers;
+	volatile LONG64 decoderHandoverMs;
+	volatile LONG64 decoderMaxHandoverMs;
+	/** How long an outranked owner gets to give way before the player is taken from it anyway. */
+	static const DWORD DECODER_HANDOVER_TIMEOUT_MS = 500;
 	CriticalSection loginCS;
-	ConditionVariable loginCondVar;
+	/** Signalled while logged in (or offline, on stored credentials), so waiters can wait for it and their abort at once. */
+	Event loggedInEvent;
 	bool loggingIn;
+	/** A login with the stored credentials blob is under way, whose failure should prompt the user. Guarded by loginCS. */
+	bool loggingInWithBlob;
 	bool loggedIn;
+	/** Since when someone's been waiting to be logged in: the session starting, or the connection dropping. Guarded by loginCS. */
+	DWORD loginWaitStartedAt;
+	bool loggedInBefore;
+	/** Guarded by spotifyCS. Relogins back off exponentially while they don't work out. */
+	DWORD lastReloginAt;
+	DWORD reloginBackoffMs;
+	static const DWORD MIN_RELOGIN_BACKOFF_MS = 1000;
+	static const DWORD MAX_RELOGIN_BACKOFF_MS = 60 * 1000;
+
+	void setLoggedIn(bool in);
+	bool loginWithStoredCredentials();
+	CriticalSection metadataCS;
+	std::vector<HANDLE> metadataWaiters;
+	std::wstring cacheDirectory;
+	/** Guarded by spotifyCS. */
+	std::vector<TrackLoadRequest *> trackLoadRequests;
+	CriticalSection commandsCS;
+	std::vector<SpotifyCommand *> commands;
+	DWORD sessionThreadId;
+	HANDLE sessionThread;
+	/** Set once, by shutdown(); the session thread takes it from there. */
+	std::atomic<bool> shutdownRequested;
+	/** Session thread only. */
+	bool shutdownStarted;
+	/** Set by shutdown() before shutdownRequested: when the session thread stops waiting to be logged out. */
+	DWORD shutdownDeadline;
+	/** Set by the session thread, with both the spotify lock and commandsCS held, just before releasing the session.
+	 * From then on commands are refused and references are dropped without calling libspotify. */
+	std::atomic<bool> released;
+	/** Lock-free stack; any thread pushes, the session thread takes the lot. */
+	std::atomic<SpotifyDeferredRelease *> deferredReleases;
+	/** Link URI to what it resolved to. Guarded by spotifyCS. */
+	std::map<std::string, ResolvedLinkEntry> resolvedLinks;
+	static const size_t MAX_RESOLVED_LINKS = 64;
+
+	static bool checkTrackLoadRequest(TrackLoadRequest &request);
+	void enqueue(SpotifyCommand &command, abort_callback &p_abort);
+	void eraseResolvedLink(std::map<std::string, ResolvedLinkEntry>::iterator it);
+	/** Requires decoderCS. */
+	void wakeDecoderWaiters();
 
 	SpotifySession();
 	~SpotifySession();
 
 public:
 	static SpotifySession & instance();
+	/** The session, if instance() has created it by now, otherwise NULL. */
+	static SpotifySession *ifCreated();
 
-	Buffer buf;
+	PcmRing buf;
+	MetadataCache metadataCache;
+	ImageCache imageCache;
+	/** Guarded by the spotify lock. */
+	ArtistPortraits artistPortraits;
 
 	sp_session *getAnyway();
 
@@ -47,19 +199,94 @@ public:
 
 	CriticalSection &getSpotifyCS();
 
+	/** The component's directory under LocalAppData, shared with libspotify's own cache. */
+	const std::wstring &getCacheDirectory();
+
 	void showLoginUI(sp_error last_login_result = SP_ERROR_OK);
 	void requireLoggedIn();
 	void waitForLogin(abort_callback & p_abort);
+	/** Never waits, nor starts logging in. */
+	bool isLoggedIn();
+	/** Starts logging in, without ever asking the user; for getting the session ready before anything is played. */
+	void warmUp();
 
 	void onLoggedIn(sp_error err);
 	void onLoggedOut();
+	void onConnectionStateUpdated();
+	void onCredentialsBlobUpdated(const char *blob);
+	void onMetadataUpdated();
+
+	/** Cached result of resolving uri, with the spotify lock held; null when there's none or it's no longer valid. */
+	std::shared_ptr<ResolvedLink> findResolvedLink(const std::string &uri);
+	/** With the spotify lock held. Pass the playlist for playlist links, so the entry can follow changes to it. */
+	void storeResolvedLink(const std::string &uri, const std::shared_ptr<ResolvedLink> &link, sp_playlist *watch);
+	void onPlaylistChanged(sp_playlist *pl);
+
+	/** ev is signalled whenever libspotify reports that some metadata (tracks, albums, artists...) has finished loading.
+	 * Add it before checking whatever you're waiting for, so that no update is missed in between. */
+	void addMetadataWaiter(Event &ev);
+	void removeMetadataWaiter(Event &ev);
+
+	/** Waits until all the tracks have loaded, throwing if any of them fails to.
+	 * Pending tracks of every waiter are checked once per metadata update, on the session thread,
+	 * and only waiters whose tracks are all done are woken up.
+	 * @param lock must hold the spotify lock; it's released while waiting. */
+	void awaitTracksLoaded(LockedCS &lock, const std::vector<sp_track *> &tracks, abort_callback &p_abort);
+	/** The same, for callers that don't hold the spotify lock: the checks run on the session thread, see call(). */
+	void awaitTracksLoaded(const std::vector<sp_track *> &tracks, abort_callback &p_abort);
 
 	void processEvents();
 
-	void takeDecoder(void *owner);
+	/** Runs f(session) on the session thread, which owns libspotify, and waits for its result; exceptions are passed on.
+	 * Callers mustn't hold the spotify lock, except on the session thread itself (i.e. in libspotify callbacks),
+	 * where f simply runs straight away.
+	 * The player and track metadata go through here. Resolving links and album art still take the lock themselves,
+	 * as their futures register libspotify callbacks that must also be removed under it. */
+	template <typename F>
+	auto call(F f, abort_callback &p_abort) -> decltype(f(static_cast<sp_session *>(NULL))) {
+		typedef decltype(f(static_cast<sp_session *>(NULL))) R;
+
+		SpotifyTaskCommand<R> command(f);
+		std::future<R> result = command.task.get_future();
+
+		if (GetCurrentThreadId() == sessionThreadId)
+			command.run(sp);
+		else
+			enqueue(command, p_abort);
+
+		return result.get();
+	}
+
+	/** Session thread only, with the spotify lock held. */
+	void runCommands();
+
+	/** Flushes libspotify's caches, logs out and releases the session, on the session thread, which then stops.
+	 * Waits for that at most budgetMs; libspotify mustn't be used any more afterwards. */
+	void shutdown(DWORD budgetMs);
+	/** Whether shutdown() has got as far as releasing the session. */
+	bool isReleased() const;
+	/** Session thread only, with the spotify lock held, after processing events.
+	 * @param nextTimeout shortened while shutting down. @return whether the thread should stop. */
+	bool continueShutdown(int &nextTimeout);
+
+	/** Has the session thread call release(ptr), for when the spotify lock is busy. Never blocks. */
+	void deferRelease(void (*release)(void *ptr), void *ptr);
+
+	/** Waits in line for the single player. An owner it outranks is asked to give way (see isPreempted()),
+	 * and has the player taken from it if it doesn't within DECODER_HANDOVER_TIMEOUT_MS.
+	 * @param resuming puts it first among its equals, for an owner that was preempted.
+	 * @return whether someone else had the player last, so their track should be unloaded. */
+	bool takeDecoder(void *owner, DecoderPriority priority, abort_callback &p_abort, bool resuming = false);
+	/** Whether someone wants the player from this owner, or has already taken it. */
+	bool isPreempted(void *owner);
+	/** Gives the player over to whoever preempted us, then waits to get it back; see takeDecoder(). */
+	bool yieldDecoder(void *owner, DecoderPriority priority, abort_callback &p_abort);
 	void ensureDecoder(void *owner);
 	void releaseDecoder(void *owner);
+	void lingerDecoder(void *owner);
 	bool hasDecoder(void *owner);
+	/** Logs how often the player changed hands, and how long that took, to the console. */
+	void reportDecoder();
 };
 
 void assertSucceeds(pfc::string8 msg, sp_error err);
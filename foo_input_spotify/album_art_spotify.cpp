@@ -4,14 +4,55 @@
 
 #include "SpotifySession.h"
 #include "SpotifyPlusPlus.h"
+#include "album_art_spotify.h"
+#include "config.h"
+#include "log_ring.h"
 
-template <typename T>
-void CALLBACK notifyEvent(T *result, void *userdata) {
-	HANDLE ev = userdata;
-	SetEvent(ev);
-	CloseHandle(ev);
+/** Logs how long an album art step took, on leaving the scope; for comparing lookups by art type. */
+class album_art_timer
+{
+private:
+	const char * m_what;
+	DWORD m_started;
+
+public:
+	album_art_timer(const char * what)
+		: m_what(what)
+		, m_started(GetTickCount())
+	{
+	}
+
+	~album_art_timer()
+	{
+		LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << m_what << " took " << (GetTickCount() - m_started) << " ms";
+	}
+};
+
+/** The size to download covers and artist pictures in; the only way to keep views showing many small covers
+ * from downloading large ones. */
+static sp_image_size cover_size()
+{
+	switch (cfg_cover_size.get())
+	{
+	case 0: return SP_IMAGE_SIZE_SMALL;
+	case 1: return SP_IMAGE_SIZE_NORMAL;
+	default: return SP_IMAGE_SIZE_LARGE;
+	}
 }
 
+/** The smallest size (64, 300 or 640 pixels) that a thumbnail of max_px can be scaled down from. */
+static sp_image_size thumbnail_source_size(unsigned max_px)
+{
+	if (max_px <= 64)
+		return SP_IMAGE_SIZE_SMALL;
+	else if (max_px <= 300)
+		return SP_IMAGE_SIZE_NORMAL;
+	else
+		return SP_IMAGE_SIZE_LARGE;
+}
+
+/** Holds on to the link's objects only; everything that needs the network waits until query() asks for a particular
+ * kind of art, and then fetches just what that needs. Waits release the spotify lock. */
 class album_art_extractor_instance_spotify : public album_art_extractor_instance
 {
 protected:
@@ -23,76 +64,148 @@ public:
 	{
 	}
 
-	virtual void initialize(LockedCS &lock, abort_callback &p_abort) {}
-
 	//! Throws exception_album_art_not_found when the requested album art entry could not be found in the referenced media file.
 	virtual album_art_data::ptr query(const GUID & p_what, abort_callback & p_abort)
 	{
 		if (p_what == album_art_ids::artist)
 		{
-			console::formatter() << "Loading artist image from Spotify";
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Loading artist image from Spotify";
+			album_art_timer timer("Artist image");
 
-			SpotifyLockScope lock;
+			SpotifySession::instance().get(p_abort);
 
-			SpotifyArtistPtr artist = get_artist(lock, p_abort);
+			DECLARE_LOCK_SITE(site);
+			SpotifyLockScope lock(site);
 
-			if (artist)
-			{
-				SpotifyArtistBrowsePtr browse;
-				Event ev(false, false);
-				browse.Attach(sp_artistbrowse_create(m_session, artist, SP_ARTISTBROWSE_NO_ALBUMS, &notifyEvent, ev.duplicateHandle()));
-				lock.waitForEvent(ev, p_abort);
+			SpotifyArtistPtr artist = get_artist(lock, p_abort);
 
-				const byte * image_id = sp_artist_portrait(artist, SP_IMAGE_SIZE_LARGE);
+			byte image_id[ImageCache::ID_SIZE];
 
-				if (image_id != nullptr)
-				{
-					return load_image_locked(image_id, lock, p_abort);
-				}
+			if (artist && SpotifySession::instance().artistPortraits.find(lock, m_session, artist, cover_size(), image_id, p_abort))
+			{
+				return load_image_locked(image_id, lock, p_abort);
 			}
 		}
 		else if (p_what == album_art_ids::cover_front)
 		{
-			console::formatter() << "Loading cover image from Spotify";
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Loading cover image from Spotify";
+			album_art_timer timer("Cover image");
+
+			SpotifySession::instance().get(p_abort);
 
-			SpotifyLockScope lock;
+			DECLARE_LOCK_SITE(site);
+			SpotifyLockScope lock(site);
 
-			SpotifyAlbumPtr album = get_album(lock, p_abort);
+			byte image_id[ImageCache::ID_SIZE];
 
-			if (album)
+			if (find_cover_locked(lock, image_id, cover_size(), p_abort))
 			{
-				SpotifyAwaitLoaded(album.m_ptr, lock, p_abort);
+				return load_image_locked(image_id, lock, p_abort);
+			}
+		}
+		else if (p_what == album_art_ids::icon)
+		{
+			// Few components ask for icons; covers in playlist views come through cover_front like any other,
+			// in cover_size(), since the album art API doesn't say how big they'll be shown.
+			// Icons are downloaded in the smallest size that will do, and scaled down.
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Loading cover thumbnail from Spotify";
+			album_art_timer timer("Cover thumbnail");
+
+			SpotifySession::instance().get(p_abort);
 
-				const byte * image_id = sp_album_cover(album, SP_IMAGE_SIZE_LARGE);
+			DECLARE_LOCK_SITE(site);
+			SpotifyLockScope lock(site);
 
-				if (image_id != nullptr)
-				{
-					return load_image_locked(image_id, lock, p_abort);
-				}
+			const unsigned max_px = static_cast<unsigned>(cfg_thumbnail_px.get());
+			byte image_id[ImageCache::ID_SIZE];
+
+			if (find_cover_locked(lock, image_id, thumbnail_source_size(max_px), p_abort))
+			{
+				return load_image_locked(image_id, lock, p_abort, IMAGE_WANTED, max_px);
 			}
 		}
 		else
 		{
-			console::formatter() << "Unsupported image type for Spotify album or track link";
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Unsupported image type for Spotify link";
 		}
 
 		throw exception_album_art_not_found();
 	}
 
-	album_art_data_ptr load_image_locked(const byte * image_id, LockedCS & lock, abort_callback & p_abort)
+	/** Gets the front cover into the image cache, unless it's there already. */
+	void prefetch_cover(abort_callback & p_abort)
 	{
-		SpotifyImagePtr image;
-		image.Attach(sp_image_create(m_session, image_id));
+		DECLARE_LOCK_SITE(site);
+		SpotifyLockScope lock(site);
 
-		SpotifyAwaitLoaded(image.m_ptr, lock, p_abort);
+		byte image_id[ImageCache::ID_SIZE];
+
+		if (find_cover_locked(lock, image_id, cover_size(), p_abort))
+		{
+			load_image_locked(image_id, lock, p_abort, IMAGE_PREFETCH);
+		}
+	}
 
-		size_t data_size = 0;
-		const void * data = sp_image_data(image, &data_size);
+	/** Copies the id of the front cover in the given size to image_id; false when there's none. */
+	virtual bool find_cover_locked(LockedCS & lock, byte * image_id, sp_image_size size, abort_callback & p_abort)
+	{
+		SpotifyAlbumPtr album = get_album(lock, p_abort);
 
-		if (data != nullptr && data_size > 0)
-			return album_art_data_impl::g_create(data, data_size);
-		else
+		if (!album)
+			return false;
+
+		SpotifyAwaitLoaded(album.m_ptr, lock, p_abort);
+
+		const byte * cover = sp_album_cover(album, size);
+
+		if (cover == nullptr)
+			return false;
+
+		memcpy(image_id, cover, ImageCache::ID_SIZE);
+		return true;
+	}
+
+	/** Goes through the session's image cache, without the spotify lock while waiting on it.
+	 * @param thumbnail_px if not 0, scales the image down to fit that many pixels. */
+	album_art_data_ptr load_image_locked(const byte * image_id, LockedCS & lock, abort_callback & p_abort, ImageRequest request = IMAGE_WANTED, unsigned thumbnail_px = 0)
+	{
+		// image_id belongs to whatever it came from, which may go away once the lock is released.
+		byte id[ImageCache::ID_SIZE];
+		memcpy(id, image_id, sizeof(id));
+
+		sp_session *session = m_session;
+		const ImageCache::Fetch fetch = [session, &id](abort_callback & a) -> album_art_data_ptr
+		{
+			DECLARE_LOCK_SITE(site);
+			SpotifyLockScope relock(site);
+
+			SpotifyFuture<sp_image> future = SpotifyImageAsync(session, id);
+			sp_image *image = future.Get(relock, a);
+			if (image == nullptr)
+				return album_art_data_ptr();
+
+			size_t data_size = 0;
+			const void * data = sp_image_data(image, &data_size);
+
+			if (data != nullptr && data_size > 0)
+				return album_art_data_impl::g_create(data, data_size);
+			else
+				return album_art_data_ptr();
+		};
+
+		ImageCache &cache = SpotifySession::instance().imageCache;
+		album_art_data_ptr result;
+		{
+			UnlockedCS unlocked(lock);
+			if (thumbnail_px != 0)
+				result = cache.getThumbnail(id, thumbnail_px, fetch, p_abort, request);
+			else
+				result = cache.get(id, fetch, p_abort, request);
+		}
+
+		if (result.is_empty())
 			throw exception_album_art_not_found();
+		return result;
 	}
 
 	virtual SpotifyAlbumPtr get_album(LockedCS & lock, abort_callback & p_abort)
@@ -118,15 +231,6 @@ public:
 	{
 	}
 
-	virtual void initialize(LockedCS &lock, abort_callback &p_abort)
-	{
-		Event ev(false, false);
-		SpotifyAlbumBrowsePtr browse;
-		browse.Attach(sp_albumbrowse_create(m_session, m_album, &notifyEvent, ev.duplicateHandle()));
-
-		lock.waitForEvent(ev, p_abort);
-	}
-
 	virtual SpotifyAlbumPtr get_album(LockedCS & lock, abort_callback & p_abort)
 	{
 		return m_album;
@@ -134,6 +238,8 @@ public:
 
 	virtual SpotifyArtistPtr get_artist(LockedCS & lock, abort_callback & p_abort)
 	{
+		SpotifyAwaitLoaded(m_album.m_ptr, lock, p_abort);
+
 		return sp_album_artist(m_album);
 	}
 };
@@ -150,15 +256,6 @@ public:
 	{
 	}
 
-	virtual void initialize(LockedCS &lock, abort_callback &p_abort)
-	{
-		Event ev(false, false);
-		SpotifyArtistBrowsePtr browse;
-		browse.Attach(sp_artistbrowse_create(m_session, m_artist, SP_ARTISTBROWSE_NO_ALBUMS, &notifyEvent, ev.duplicateHandle()));
-
-		lock.waitForEvent(ev, p_abort);
-	}
-
 	virtual SpotifyAlbumPtr get_album(LockedCS & lock, abort_callback & p_abort)
 	{
 		return nullptr;
@@ -182,26 +279,20 @@ public:
 	{
 	}
 
-	virtual void initialize(LockedCS &lock, abort_callback &p_abort)
+	virtual SpotifyAlbumPtr get_album(LockedCS & lock, abort_callback & p_abort)
 	{
 		SpotifyAwaitLoaded(m_track.m_ptr, lock, p_abort);
 
-		SpotifyAlbumPtr album = sp_track_album(m_track);
-
-		Event ev(false, false);
-		SpotifyAlbumBrowsePtr browse;
-		browse.Attach(sp_albumbrowse_create(m_session, album, &notifyEvent, ev.duplicateHandle()));
-
-		lock.waitForEvent(ev, p_abort);
-	}
-
-	virtual SpotifyAlbumPtr get_album(LockedCS & lock, abort_callback & p_abort)
-	{
 		return sp_track_album(m_track);
 	}
 
 	virtual SpotifyArtistPtr get_artist(LockedCS & lock, abort_callback & p_abort)
 	{
+		SpotifyAwaitLoaded(m_track.m_ptr, lock, p_abort);
+
+		if (sp_track_num_artists(m_track) == 0)
+			return nullptr;
+
 		return sp_track_artist(m_track, 0);
 	}
 };
@@ -219,40 +310,65 @@ public:
 	{
 	}
 
-	virtual void initialize(LockedCS &lock, abort_callback &p_abort)
+	virtual bool find_cover_locked(LockedCS & lock, byte * image_id, sp_image_size size, abort_callback & p_abort)
 	{
-	}
-
-	virtual album_art_data::ptr query(const GUID & p_what, abort_callback & p_abort)
-	{
-		if (p_what == album_art_ids::cover_front)
+		// Playlists have their image in one size only.
+		if (!m_playlist)
 		{
-			console::formatter() << "Loading cover image from Spotify";
-
-			SpotifyLockScope lock;
-
+			SpotifyFuture<sp_playlist> future = SpotifyPlaylistAsync(m_session, m_link);
+			m_playlist = future.Get(lock, p_abort);
 			if (!m_playlist)
-			{
-				m_playlist.Attach(sp_playlist_create(m_session, m_link));
+				return false;
+		}
 
-				SpotifyAwaitLoaded(m_playlist.m_ptr, lock, p_abort);
-			}
+		return sp_playlist_get_image(m_playlist, image_id);
+	}
+};
 
-			byte image_id[20];
+/** An extractor instance for whatever p_path links to, or null if it's no link we have art for. With the spotify lock held. */
+static service_ptr_t<album_art_extractor_instance_spotify> create_instance_locked(const char * p_path, sp_session * session)
+{
+	SpotifyLinkPtr link;
+	link.Attach(sp_link_create_from_string(p_path));
 
-			if (sp_playlist_get_image(m_playlist, image_id))
-			{
-				return load_image_locked(image_id, lock, p_abort);
-			}
-		}
-		else
+	service_ptr_t<album_art_extractor_instance_spotify> instance;
+
+	if (link)
+	{
+		switch (sp_link_type(link))
 		{
-			console::formatter() << "Unsupported image type for Spotify playlist link";
+		case SP_LINKTYPE_ALBUM:
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Creating album art extractor for Spotify album link";
+			instance = new service_impl_t<album_art_extractor_instance_spotify_album>(sp_link_as_album(link), session);
+			break;
+
+		case SP_LINKTYPE_ARTIST:
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Creating album art extractor for Spotify artist link";
+			instance = new service_impl_t<album_art_extractor_instance_spotify_artist>(sp_link_as_artist(link), session);
+			break;
+
+		case SP_LINKTYPE_TRACK:
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Creating album art extractor for Spotify track link";
+			instance = new service_impl_t<album_art_extractor_instance_spotify_track>(sp_link_as_track(link), session);
+			break;
+
+		case SP_LINKTYPE_PLAYLIST:
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Creating album art extractor for Spotify playlist link";
+			instance = new service_impl_t<album_art_extractor_instance_spotify_playlist>(link, session);
+			break;
+
+		default:
+			LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Unsupported type of Spotify link";
+			break;
 		}
-
-		throw exception_album_art_not_found();
 	}
-};
+	else
+	{
+		LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Not a valid Spotify link";
+	}
+
+	return instance;
+}
 
 class album_art_extractor_spotify : public album_art_extractor
 {
@@ -270,55 +386,19 @@ public:
 	//! @param p_filehint Optional; specifies a file interface to use for accessing the specified file; can be null - in that case, the implementation will open and close the file internally.
 	virtual album_art_extractor_instance::ptr open(file_ptr p_filehint, const char * p_path, abort_callback & p_abort)
 	{
-		console::formatter() << "Opening track for loading album art from Spotify: " << p_path;
-
-		sp_session *session = SpotifySession::instance().get(p_abort);
+		LogFormatter(LOG_ALBUM_ART, LOG_DEBUG) << "Opening track for loading album art from Spotify: " << p_path;
+		album_art_timer timer("Opening for album art");
 
-		SpotifyLockScope lock;
+		// Parsing the link needs no login; query() waits for that, if art is wanted at all.
+		sp_session *session = SpotifySession::instance().getAnyway();
 
-		SpotifyLinkPtr link;
-		link.Attach(sp_link_create_from_string(p_path));
+		DECLARE_LOCK_SITE(site);
+		SpotifyLockScope lock(site);
 
-		service_ptr_t<album_art_extractor_instance_spotify> instance;
-
-		if (link)
-		{
-			switch (sp_link_type(link))
-			{
-			case SP_LINKTYPE_ALBUM:
-				console::formatter() << "Creating album art extractor for Spotify album link";
-				instance = new service_impl_t<album_art_extractor_instance_spotify_album>(sp_link_as_album(link), session);
-				break;
-
-			case SP_LINKTYPE_ARTIST:
-				console::formatter() << "Creating album art extractor for Spotify artist link";
-				instance = new service_impl_t<album_art_extractor_instance_spotify_artist>(sp_link_as_artist(link), session);
-				break;
-
-			case SP_LINKTYPE_TRACK:
-				console::formatter() << "Creating album art extractor for Spotify track link";
-				instance = new service_impl_t<album_art_extractor_instance_spotify_track>(sp_link_as_track(link), session);
-				break;
-
-			case SP_LINKTYPE_PLAYLIST:
-				console::formatter() << "Creating album art extractor for Spotify playlist link";
-				instance = new service_impl_t<album_art_extractor_instance_spotify_playlist>(link, session);
-				break;
-
-			default:
-				console::formatter() << "Unsupported type of Spotify link";
-				break;
-			}
-		}
-		else
-		{
-			console::formatter() << "Not a valid Spotify link";
-		}
+		service_ptr_t<album_art_extractor_instance_spotify> instance = create_instance_locked(p_path, session);
 
 		if (instance.is_valid())
 		{
-			console::formatter() << "Initializing album art extractor for Spotify link";
-			instance->initialize(lock, p_abort);
 			return instance;
 		}
 		else
@@ -329,3 +409,19 @@ public:
 };
 
 static service_factory_single_t<album_art_extractor_spotify> g_album_art_extractory_spotify_factory;
+
+void prefetch_album_art(const char * p_path, abort_callback & p_abort)
+{
+	service_ptr_t<album_art_extractor_instance_spotify> instance;
+	{
+		DECLARE_LOCK_SITE(site);
+		SpotifyLockScope lock(site);
+
+		instance = create_instance_locked(p_path, SpotifySession::instance().getAnyway());
+	}
+
+	if (instance.is_valid())
+	{
+		instance->prefetch_cover(p_abort);
+	}
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/** Gets the front cover of the track, album or playlist p_path links to into the image cache, unless it's there already.
+ * Doesn't wait for login; throws exception_album_art_not_found when there's no cover. */
+void prefetch_album_art(const char * p_path, abort_callback & p_abort);
@@ -0,0 +1,196 @@
+#include "pch.h"
+
+#include "art_prefetch.h"
+#include "album_art_spotify.h"
+#include "config.h"
+#include "SpotifySession.h"
+
+#include <algorithm>
+
+/** Follows the active playlist and playback, main thread only, and tells the prefetcher what's coming up. */
+class ArtPrefetchWatcher : public playlist_callback_impl_base, public play_callback_impl_base {
+public:
+	ArtPrefetchWatcher()
+		: playlist_callback_impl_base(flag_on_items_added | flag_on_item_focus_change | flag_on_item_ensure_visible | flag_on_playlist_activate)
+		, play_callback_impl_base(flag_on_playback_new_track) {
+	}
+
+	void on_items_added(t_size p_playlist, t_size p_start, const pfc::list_base_const_t<metadb_handle_ptr> &p_data, const bit_array &p_selection) {
+		if (isActive(p_playlist))
+			refresh(p_playlist, focusOf(p_playlist));
+	}
+
+	void on_item_focus_change(t_size p_playlist, t_size p_from, t_size p_to) {
+		if (isActive(p_playlist) && p_to != pfc_infinite)
+			refresh(p_playlist, p_to);
+	}
+
+	void on_item_ensure_visible(t_size p_playlist, t_size p_idx) {
+		if (isActive(p_playlist))
+			refresh(p_playlist, p_idx);
+	}
+
+	void on_playlist_activate(t_size p_old, t_size p_new) {
+		if (p_new != pfc_infinite)
+			refresh(p_new, focusOf(p_new));
+	}
+
+	void on_playback_new_track(metadb_handle_ptr p_track) {
+		SpotifySession *session = SpotifySession::ifCreated();
+		if (session != NULL)
+			session->imageCache.reportHitRate();
+
+		static_api_ptr_t<playlist_manager> pm;
+		t_size playlist, index;
+		if (pm->get_playing_item_location(&playlist, &index))
+			refresh(playlist, index + 1);
+	}
+
+private:
+	static bool isActive(t_size playlist) {
+		return static_api_ptr_t<playlist_manager>()->get_active_playlist() == playlist;
+	}
+
+	static t_size focusOf(t_size playlist) {
+		const t_size focus = static_api_ptr_t<playlist_manager>()->playlist_get_focus_item(playlist);
+		return focus == pfc_infinite ? 0 : focus;
+	}
+
+	static void add(const metadb_handle_ptr &item, std::vector<std::string> &paths) {
+		const char *path = item->get_path();
+		if (strncmp(path, "spotify:", strlen("spotify:")))
+			return;
+		if (std::find(paths.begin(), paths.end(), path) == paths.end())
+			paths.push_back(path);
+	}
+
+	/** Schedules the playback queue, then the entries of playlist from index on. */
+	void refresh(t_size playlist, t_size from) {
+		const size_t limit = static_cast<size_t>(cfg_art_prefetch_items.get());
+		std::vector<std::string> paths;
+
+		if (limit > 0) {
+			static_api_ptr_t<playlist_manager> pm;
+
+			pfc::list_t<t_playback_queue_item> queue;
+			pm->queue_get_contents(queue);
+			for (t_size i = 0; i < queue.get_count() && paths.size() < limit; ++i)
+				add(queue[i].m_handle, paths);
+
+			const t_size count = pm->playlist_get_item_count(playlist);
+			for (t_size i = from; i < count && paths.size() < limit; ++i)
+				add(pm->playlist_get_item_handle(playlist, i), paths);
+		}
+
+		ArtPrefetcher::instance().schedule(paths);
+	}
+};
+
+ArtPrefetcher &ArtPrefetcher::instance() {
+	static ArtPrefetcher prefetcher;
+
+	return prefetcher;
+}
+
+ArtPrefetcher::ArtPrefetcher() : stopping(false) {
+}
+
+ArtPrefetcher::~ArtPrefetcher() {
+}
+
+void ArtPrefetcher::start() {
+	const int threads = static_cast<int>(cfg_art_prefetch_threads.get());
+	for (int i = 0; i < threads; ++i) {
+		std::unique_ptr<Worker> worker(new Worker);
+		worker->prefetcher = this;
+		worker->thread = CreateThread(NULL, 0, &workerThread, worker.get(), 0, NULL);
+		if (NULL == worker->thread)
+			break;
+		SetThreadPriority(worker->thread, THREAD_PRIORITY_LOWEST);
+		workers.push_back(std::move(worker));
+	}
+
+	watcher.reset(new ArtPrefetchWatcher);
+}
+
+void ArtPrefetcher::shutdown() {
+	watcher.reset();
+
+	{
+		LockedCS lock(cs);
+		stopping = true;
+		queue.clear();
+		for (size_t i = 0; i < workers.size(); ++i)
+			workers[i]->abort.abort();
+	}
+	queued.wakeAll();
+
+	// Aborted, they return soon; and they use their Worker until they do.
+	for (size_t i = 0; i < workers.size(); ++i) {
+		WaitForSingleObject(workers[i]->thread, INFINITE);
+		CloseHandle(workers[i]->thread);
+	}
+	workers.clear();
+}
+
+void ArtPrefetcher::schedule(const std::vector<std::string> &paths) {
+	{
+		LockedCS lock(cs);
+		if (stopping)
+			return;
+
+		queue.clear();
+		for (size_t i = 0; i < paths.size(); ++i) {
+			// Already under way: let it finish rather than start over.
+			bool running = false;
+			for (size_t j = 0; j < workers.size(); ++j)
+				running = running || workers[j]->current == paths[i];
+			if (!running)
+				queue.push_back(paths[i]);
+		}
+
+		for (size_t j = 0; j < workers.size(); ++j) {
+			Worker &worker = *workers[j];
+			if (!worker.current.empty() && std::find(paths.begin(), paths.end(), worker.current) == paths.end())
+				worker.abort.abort();
+		}
+	}
+	queued.wakeAll();
+}
+
+void ArtPrefetcher::run(Worker &worker) {
+	while (true) {
+		std::string path;
+		{
+			LockedCS lock(cs);
+			worker.current.clear();
+			while (queue.empty() && !stopping)
+				queued.sleep(cs);
+			if (stopping)
+				return;
+
+			path = queue.front();
+			queue.pop_front();
+			worker.current = path;
+			worker.abort.reset();
+		}
+
+		// Never log in, let alone ask the user to, just for this.
+		SpotifySession *session = SpotifySession::ifCreated();
+		if (NULL == session || !session->isLoggedIn())
+			continue;
+
+		try {
+			prefetch_album_art(path.c_str(), worker.abort);
+		}
+		catch (const std::exception &) {
+			// Aborted, or there's no cover; whoever wants it will find out for themselves.
+		}
+	}
+}
+
+DWORD WINAPI ArtPrefetcher::workerThread(void *data) {
+	Worker *worker = static_cast<Worker *>(data);
+	worker->prefetcher->run(*worker);
+	return 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "util.h"
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ArtPrefetchWatcher;
+
+/** Warms the image cache with the covers of what's likely to be shown or played next:
+ * the playback queue, then the entries after the playing or focused one in the active playlist.
+ * A few low priority threads do the work, which caps how much is fetched at once; they run at normal priority
+ * while holding the spotify lock (see SpotifyLockScope). Whenever the view changes,
+ * what's still waiting is replaced, and prefetches for entries that are no longer upcoming are aborted.
+ * Nothing is prefetched while logged out.
+ */
+class ArtPrefetcher : boost::noncopyable {
+public:
+	static ArtPrefetcher &instance();
+
+	/** Main thread. Starts the worker threads, and watching playlists and playback. */
+	void start();
+	/** Main thread. Stops watching, aborts what's under way and waits for the worker threads. */
+	void shutdown();
+
+	/** Main thread. Replaces whatever's waiting to be prefetched with paths, in order. */
+	void schedule(const std::vector<std::string> &paths);
+
+private:
+	struct Worker {
+		ArtPrefetcher *prefetcher;
+		HANDLE thread;
+		abort_callback_impl abort;
+		/** What it's prefetching; empty while idle. Guarded by cs. */
+		std::string current;
+	};
+
+	CriticalSection cs;
+	ConditionVariable queued;
+	/** Guarded by cs. */
+	std::deque<std::string> queue;
+	bool stopping;
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::unique_ptr<ArtPrefetchWatcher> watcher;
+
+	ArtPrefetcher();
+	~ArtPrefetcher();
+
+	void run(Worker &worker);
+	static DWORD WINAPI workerThread(void *data);
+};
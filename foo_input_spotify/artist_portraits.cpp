@@ -0,0 +1,142 @@
+#include "pch.h"
+
+#include "artist_portraits.h"
+#include "SpotifyPlusPlus.h"
+
+namespace {
+	/** Sizes to try for each requested one, by sp_image_size: the size itself, then the nearest bigger, then smaller. */
+	const sp_image_size PREFERENCES[3][3] = {
+		/* SP_IMAGE_SIZE_NORMAL */ { SP_IMAGE_SIZE_NORMAL, SP_IMAGE_SIZE_LARGE, SP_IMAGE_SIZE_SMALL },
+		/* SP_IMAGE_SIZE_SMALL */ { SP_IMAGE_SIZE_SMALL, SP_IMAGE_SIZE_NORMAL, SP_IMAGE_SIZE_LARGE },
+		/* SP_IMAGE_SIZE_LARGE */ { SP_IMAGE_SIZE_LARGE, SP_IMAGE_SIZE_NORMAL, SP_IMAGE_SIZE_SMALL },
+	};
+}
+
+ArtistPortraits::ArtistPortraits() : lookups(0), browses(0), joined(0) {
+}
+
+/** Requires the spotify lock and a loaded artist. */
+std::string ArtistPortraits::uriOf(sp_artist *artist) {
+	SpotifyLinkPtr link;
+	link.Attach(sp_link_create_from_artist(artist));
+
+	char uri[256];
+	if (!link || sp_link_as_string(link, uri, sizeof(uri)) <= 0)
+		return std::string();
+	return uri;
+}
+
+std::string ArtistPortraits::portraitOf(sp_artist *artist, sp_image_size size) {
+	const byte *id = sp_artist_portrait(artist, size);
+	return id != NULL ? std::string(reinterpret_cast<const char *>(id), ID_SIZE) : std::string();
+}
+
+bool ArtistPortraits::pick(const Entry &entry, sp_image_size size, byte *image_id) {
+	for (int i = 0; i < 3; ++i) {
+		const std::string &id = entry.bySize[PREFERENCES[size][i]];
+		if (!id.empty()) {
+			memcpy(image_id, id.data(), ID_SIZE);
+			return true;
+		}
+	}
+
+	if (entry.fallback.empty())
+		return false;
+	memcpy(image_id, entry.fallback.data(), ID_SIZE);
+	return true;
+}
+
+/** Makes room for one more entry, dropping the least recently used complete one. */
+void ArtistPortraits::evict() {
+	if (entries.size() < MAX_ENTRIES)
+		return;
+
+	const DWORD now = GetTickCount();
+	std::map<std::string, Entry>::iterator oldest = entries.end();
+	for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+		if (it->second.done && (oldest == entries.end() || now - it->second.lastUsed > now - oldest->second.lastUsed))
+			oldest = it;
+	}
+	if (oldest != entries.end())
+		entries.erase(oldest);
+}
+
+bool ArtistPortraits::find(LockedCS &lock, sp_session *session, sp_artist *artist, sp_image_size size, byte *image_id, abort_callback &p_abort) {
+	InterlockedIncrement64(&lookups);
+
+	SpotifyAwaitLoaded(artist, lock, p_abort);
+
+	const std::string uri = uriOf(artist);
+	if (uri.empty())
+		return false;
+
+	while (true) {
+		std::map<std::string, Entry>::iterator it = entries.find(uri);
+		if (it == entries.end())
+			break;
+
+		if (it->second.done) {
+			it->second.lastUsed = GetTickCount();
+			return pick(it->second, size, image_id);
+		}
+
+		// Someone's looking it up already; the entry is complete once they're done, or gone if they failed.
+		const std::shared_ptr<Event> resolved = it->second.resolved;
+		InterlockedIncrement64(&joined);
+		lock.waitForEvent(*resolved, p_abort);
+	}
+
+	evict();
+	const std::shared_ptr<Event> resolved = std::make_shared<Event>(TRUE, FALSE);
+	{
+		Entry &entry = entries[uri];
+		entry.resolved = resolved;
+		entry.done = false;
+		entry.lastUsed = GetTickCount();
+	}
+
+	try {
+		Entry found;
+		bool any = false;
+		for (int s = 0; s < 3; ++s) {
+			found.bySize[s] = portraitOf(artist, static_cast<sp_image_size>(s));
+			any = any || !found.bySize[s].empty();
+		}
+
+		if (!any) {
+			// Portraits aren't always there before the artist has been browsed.
+			InterlockedIncrement64(&browses);
+			SpotifyFuture<sp_artistbrowse> future = SpotifyArtistBrowseAsync(session, artist, SP_ARTISTBROWSE_NO_ALBUMS);
+			sp_artistbrowse *browse = future.Get(lock, p_abort);
+			if (browse == nullptr || sp_artistbrowse_error(browse) != SP_ERROR_OK)
+				throw exception_album_art_not_found();
+
+			for (int s = 0; s < 3; ++s)
+				found.bySize[s] = portraitOf(artist, static_cast<sp_image_size>(s));
+			if (sp_artistbrowse_num_portraits(browse) > 0)
+				found.fallback.assign(reinterpret_cast<const char *>(sp_artistbrowse_portrait(browse, 0)), ID_SIZE);
+		}
+
+		// Only whoever created an entry completes or removes it, so it's still there.
+		Entry &entry = entries[uri];
+		for (int s = 0; s < 3; ++s)
+			entry.bySize[s] = found.bySize[s];
+		entry.fallback = found.fallback;
+		entry.done = true;
+		entry.resolved.reset();
+		SetEvent(resolved->handle);
+
+		return pick(entry, size, image_id);
+	}
+	catch (...) {
+		// Not kept: the next lookup tries again.
+		entries.erase(uri);
+		SetEvent(resolved->handle);
+		throw;
+	}
+}
+
+void ArtistPortraits::report() {
+	console::formatter() << "spotify artist portraits: " << lookups << " lookups, " << browses << " browses, "
+		<< joined << " joined a lookup under way";
+}
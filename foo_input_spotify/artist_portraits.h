@@ -0,0 +1,49 @@
+#pragma once
+
+#include "util.h"
+#include <map>
+#include <memory>
+#include <string>
+
+/** Artists' portrait ids, looked up once per artist and kept for the session, keyed by artist URI.
+ * A loaded artist often knows its portraits already; otherwise it's browsed, without albums, once however many
+ * ask at the same time, and the browse's own portraits are the fallback. Guarded by the spotify lock.
+ */
+class ArtistPortraits : boost::noncopyable {
+public:
+	static const size_t ID_SIZE = 20;
+	static const size_t MAX_ENTRIES = 1024;
+
+	ArtistPortraits();
+
+	/** Copies the id of the artist's portrait in the given size, or the nearest size there is, to image_id;
+	 * false when the artist has none.
+	 * @param lock must hold the spotify lock; it's released while waiting. */
+	bool find(LockedCS &lock, sp_session *session, sp_artist *artist, sp_image_size size, byte *image_id, abort_callback &p_abort);
+
+	/** Logs lookups, and how many of them needed a browse, to the console. */
+	void report();
+
+private:
+	struct Entry {
+		/** sp_artist_portrait() by sp_image_size; empty for sizes there's none in. */
+		std::string bySize[3];
+		/** sp_artistbrowse_portrait() 0, if the artist had to be browsed. */
+		std::string fallback;
+		/** Set once the entry is complete; until then, others wait for whoever's looking the artist up. */
+		std::shared_ptr<Event> resolved;
+		bool done;
+		DWORD lastUsed;
+	};
+
+	std::map<std::string, Entry> entries;
+
+	volatile LONG64 lookups;
+	volatile LONG64 browses;
+	volatile LONG64 joined;
+
+	static std::string uriOf(sp_artist *artist);
+	static std::string portraitOf(sp_artist *artist, sp_image_size size);
+	static bool pick(const Entry &entry, sp_image_size size, byte *image_id);
+	void evict();
+};
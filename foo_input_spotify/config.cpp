@@ -0,0 +1,58 @@
+#include "pch.h"
+
+#include "config.h"
+
+static const GUID guid_branch_spotify = { 0xc714e9c4, 0x4fd6, 0x4250, { 0xba, 0xc2, 0xe8, 0xb4, 0xd7, 0x2c, 0x6a, 0x3e } };
+static const GUID guid_prefetch_seconds = { 0x951c0531, 0xa45e, 0x4026, { 0x8c, 0xcf, 0x9d, 0xc0, 0x9f, 0x4c, 0xf2, 0xb6 } };
+static const GUID guid_lazy_track_threshold = { 0x9b07d5eb, 0x0e6b, 0x4732, { 0x90, 0x80, 0x04, 0xf7, 0x4a, 0x19, 0x7e, 0xfa } };
+static const GUID guid_metadata_cache_days = { 0x0d2994ec, 0x3843, 0x49c5, { 0x99, 0x35, 0x72, 0x0e, 0x6b, 0x93, 0x70, 0x00 } };
+static const GUID guid_log_lock_contention = { 0x5df86509, 0xad26, 0x4c92, { 0xb6, 0x89, 0xdc, 0x7e, 0xfe, 0x92, 0x82, 0xc4 } };
+static const GUID guid_log_buffer_stats = { 0x3e6f1a2d, 0x8b47, 0x4c19, { 0xa5, 0x0e, 0x71, 0xd2, 0x9c, 0x43, 0xb8, 0x6f } };
+static const GUID guid_buffer_ms = { 0x6a0d3c85, 0x1f92, 0x4e7b, { 0x9c, 0x14, 0x2b, 0x58, 0xe7, 0x0a, 0xd3, 0x61 } };
+static const GUID guid_buffer_adaptive = { 0xb4e2719f, 0x5c06, 0x4a3d, { 0x87, 0xf1, 0x0e, 0x6c, 0x92, 0x3b, 0x45, 0xa8 } };
+static const GUID guid_shutdown_ms = { 0x4c8a0e37, 0x92d1, 0x4b6f, { 0xa3, 0x7e, 0x15, 0xf0, 0x6d, 0x29, 0xc8, 0x54 } };
+static const GUID guid_log_level = { 0x7d15b0c2, 0x3a6e, 0x4f41, { 0x8b, 0x9d, 0x60, 0xe2, 0x1f, 0x7a, 0x34, 0xcb } };
+static const GUID guid_log_file = { 0xe9a3624f, 0x0c7b, 0x45d8, { 0xa1, 0x36, 0x5f, 0x8d, 0xc2, 0x07, 0x9e, 0x13 } };
+static const GUID guid_image_cache_memory_mb = { 0x2f7b94d1, 0x6e08, 0x4c3a, { 0x9d, 0x52, 0xb1, 0x0c, 0x47, 0xe8, 0x3a, 0x96 } };
+static const GUID guid_image_cache_disk_mb = { 0x85c1e6a0, 0xd43f, 0x4b97, { 0xae, 0x2d, 0x6f, 0x19, 0x30, 0xc7, 0x5b, 0xe4 } };
+static const GUID guid_art_prefetch_items = { 0x1b9e4c72, 0x0a63, 0x4d5f, { 0x8e, 0x21, 0xc4, 0x7d, 0x95, 0x3f, 0x06, 0xba } };
+static const GUID guid_art_prefetch_threads = { 0xd06f2a8e, 0x57b4, 0x4e19, { 0xb3, 0x8c, 0x2a, 0xe1, 0x64, 0x0f, 0x9d, 0x75 } };
+static const GUID guid_cover_size = { 0x63a8d2f5, 0xc91e, 0x4077, { 0x95, 0x4b, 0x3d, 0x0e, 0x82, 0x6a, 0xf1, 0x19 } };
+static const GUID guid_thumbnail_px = { 0xa47c0b19, 0x2e85, 0x43d6, { 0xbc, 0x60, 0x91, 0x5f, 0x28, 0xd4, 0x7e, 0x03 } };
+static const GUID guid_link_cache_minutes = { 0x0227c278, 0x7b3b, 0x446d, { 0xb2, 0xcb, 0xc9, 0x74, 0x34, 0xf1, 0x67, 0x1e } };
+
+static advconfig_branch_factory branch_spotify("Spotify", guid_branch_spotify, advconfig_entry::guid_branch_decoding, 0);
+
+advconfig_integer_factory cfg_lazy_track_threshold("Load tracks of playlists and artists on demand when there are more than this many", guid_lazy_track_threshold, guid_branch_spotify, 1, 200, 0, 1000000);
+
+advconfig_integer_factory cfg_metadata_cache_days("Keep track metadata on disk for this many days (0 disables the cache)", guid_metadata_cache_days, guid_branch_spotify, 2, 30, 0, 3650, preferences_state::needs_restart);
+
+advconfig_integer_factory cfg_link_cache_minutes("Reuse resolved album, artist and search links for this many minutes (0 disables; playlists are followed for changes)", guid_link_cache_minutes, guid_branch_spotify, 3, 10, 0, 24 * 60);
+
+advconfig_integer_factory cfg_prefetch_seconds("Prefetch next track this many seconds before the end of the current one", guid_prefetch_seconds, guid_branch_spotify, 0, 15, 0, 600);
+
+advconfig_integer_factory cfg_buffer_ms("Buffer this many milliseconds of audio ahead", guid_buffer_ms, guid_branch_spotify, 4, 4000, 500, 5000);
+
+advconfig_checkbox_factory cfg_buffer_adaptive("Adapt the buffer to the connection: grow it after dropouts, shrink it while playback is stable", guid_buffer_adaptive, guid_branch_spotify, 5, true);
+
+advconfig_integer_factory cfg_shutdown_ms("Allow this many milliseconds on exit for flushing caches and logging out", guid_shutdown_ms, guid_branch_spotify, 6, 3000, 0, 30000);
+
+advconfig_integer_factory cfg_image_cache_memory_mb("Keep this many megabytes of album art in memory (0 disables)", guid_image_cache_memory_mb, guid_branch_spotify, 7, 32, 0, 1024);
+
+advconfig_integer_factory cfg_image_cache_disk_mb("Keep this many megabytes of album art on disk (0 disables)", guid_image_cache_disk_mb, guid_branch_spotify, 8, 256, 0, 16384, preferences_state::needs_restart);
+
+advconfig_integer_factory cfg_cover_size("Size of covers and artist pictures to download, also for small views (0 small, 1 normal, 2 large)", guid_cover_size, guid_branch_spotify, 9, 2, 0, 2);
+
+advconfig_integer_factory cfg_thumbnail_px("Scale album icons (not covers) down to this many pixels", guid_thumbnail_px, guid_branch_spotify, 10, 128, 16, 640);
+
+advconfig_integer_factory cfg_art_prefetch_items("Prefetch album art for this many upcoming playlist entries (0 disables)", guid_art_prefetch_items, guid_branch_spotify, 11, 20, 0, 500);
+
+advconfig_integer_factory cfg_art_prefetch_threads("Prefetch album art for at most this many entries at once", guid_art_prefetch_threads, guid_branch_spotify, 12, 2, 1, 8, preferences_state::needs_restart);
+
+advconfig_checkbox_factory cfg_log_lock_contention("Log lock contention statistics to the console every minute", guid_log_lock_contention, guid_branch_spotify, 13, false);
+
+advconfig_checkbox_factory cfg_log_buffer_stats("Log audio buffer statistics (stutters, refills) to the console every minute", guid_log_buffer_stats, guid_branch_spotify, 14, false);
+
+advconfig_integer_factory cfg_log_level("Log messages of at least this level (0 debug, 1 info, 2 warning, 3 error)", guid_log_level, guid_branch_spotify, 15, 1, 0, 3);
+
+advconfig_string_factory_MT cfg_log_file("Also append log messages to this file (empty for none)", guid_log_file, guid_branch_spotify, 16, "");
@@ -0,0 +1,21 @@
+#pragma once
+
+// Advanced preferences, under Decoding > Spotify.
+
+extern advconfig_integer_factory cfg_prefetch_seconds;
+extern advconfig_integer_factory cfg_lazy_track_threshold;
+extern advconfig_integer_factory cfg_metadata_cache_days;
+extern advconfig_checkbox_factory cfg_log_lock_contention;
+extern advconfig_integer_factory cfg_link_cache_minutes;
+extern advconfig_checkbox_factory cfg_log_buffer_stats;
+extern advconfig_integer_factory cfg_buffer_ms;
+extern advconfig_checkbox_factory cfg_buffer_adaptive;
+extern advconfig_integer_factory cfg_shutdown_ms;
+extern advconfig_integer_factory cfg_image_cache_memory_mb;
+extern advconfig_integer_factory cfg_image_cache_disk_mb;
+extern advconfig_integer_factory cfg_cover_size;
+extern advconfig_integer_factory cfg_thumbnail_px;
+extern advconfig_integer_factory cfg_art_prefetch_items;
+extern advconfig_integer_factory cfg_art_prefetch_threads;
+extern advconfig_integer_factory cfg_log_level;
+extern advconfig_string_factory_MT cfg_log_file;
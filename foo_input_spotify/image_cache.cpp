@@ -0,0 +1,274 @@
+#include "pch.h"
+
+#include "image_cache.h"
+#include "config.h"
+#include "log_ring.h"
+#include "thumbnail.h"
+
+#include <algorithm>
+#include <vector>
+
+ImageCache::ImageCache() : memoryBytes(0), memoryHits(0), diskHits(0), fetches(0), prefetches(0), fetchedBytes(0), thumbnails(0), wanted(0), wantedHits(0),
+		reportedWanted(0), reportedWantedHits(0) {
+}
+
+void ImageCache::open(const std::wstring &cacheDirectory) {
+	const t_uint64 maxBytes = cfg_image_cache_disk_mb.get() * 1024 * 1024;
+	if (maxBytes == 0)
+		return;
+
+	directory = cacheDirectory + L"\\images";
+	CreateDirectoryW(directory.c_str(), NULL);
+	trim(maxBytes);
+}
+
+std::string ImageCache::key(const byte *id) {
+	static const char digits[] = "0123456789abcdef";
+	std::string out(2 * ID_SIZE, '0');
+	for (size_t i = 0; i < ID_SIZE; ++i) {
+		out[2 * i] = digits[id[i] >> 4];
+		out[2 * i + 1] = digits[id[i] & 0xf];
+	}
+	return out;
+}
+
+std::wstring ImageCache::pathOf(const std::string &key) const {
+	return directory + L"\\" + std::wstring(key.begin(), key.end());
+}
+
+/** Requires cs. */
+album_art_data::ptr ImageCache::findInMemory(const std::string &key) {
+	std::map<std::string, Lru::iterator>::iterator it = index.find(key);
+	if (it == index.end())
+		return album_art_data::ptr();
+
+	lru.splice(lru.begin(), lru, it->second);
+	return it->second->second;
+}
+
+/** Requires cs. */
+void ImageCache::remember(const std::string &key, const album_art_data::ptr &data) {
+	if (index.find(key) != index.end())
+		return;
+
+	const t_uint64 budget = cfg_image_cache_memory_mb.get() * 1024 * 1024;
+	if (data->get_size() > budget)
+		return;
+
+	lru.push_front(std::make_pair(key, data));
+	index[key] = lru.begin();
+	memoryBytes += data->get_size();
+
+	while (memoryBytes > budget) {
+		memoryBytes -= lru.back().second->get_size();
+		index.erase(lru.back().first);
+		lru.pop_back();
+	}
+}
+
+album_art_data::ptr ImageCache::readFile(const std::string &key) {
+	if (directory.empty())
+		return album_art_data::ptr();
+
+	const HANDLE file = CreateFileW(pathOf(key).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file)
+		return album_art_data::ptr();
+
+	album_art_data::ptr data;
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart < 0x10000000) {
+		std::vector<char> buffer(static_cast<size_t>(size.QuadPart));
+		DWORD read = 0;
+		if (ReadFile(file, &buffer[0], static_cast<DWORD>(buffer.size()), &read, NULL) && read == buffer.size())
+			data = album_art_data_impl::g_create(&buffer[0], buffer.size());
+	}
+	CloseHandle(file);
+	return data;
+}
+
+void ImageCache::writeFile(const std::string &key, const album_art_data::ptr &data) {
+	if (directory.empty())
+		return;
+
+	// Write under a temporary name first, so a crash can't leave a truncated image behind under the real one.
+	const std::wstring path = pathOf(key);
+	const std::wstring temporary = path + L".tmp";
+	const HANDLE file = CreateFileW(temporary.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file)
+		return;
+
+	DWORD written = 0;
+	const BOOL ok = WriteFile(file, data->get_ptr(), static_cast<DWORD>(data->get_size()), &written, NULL) && written == data->get_size();
+	CloseHandle(file);
+
+	if (!ok || !MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		DeleteFileW(temporary.c_str());
+}
+
+/** Deletes the least recently written images until the store fits in maxBytes. */
+void ImageCache::trim(t_uint64 maxBytes) {
+	struct File {
+		FILETIME written;
+		t_uint64 size;
+		std::wstring name;
+
+		bool operator<(const File &other) const {
+			return CompareFileTime(&written, &other.written) < 0;
+		}
+	};
+
+	std::vector<File> files;
+	t_uint64 total = 0;
+
+	WIN32_FIND_DATAW found;
+	const HANDLE search = FindFirstFileW((directory + L"\\*").c_str(), &found);
+	if (INVALID_HANDLE_VALUE == search)
+		return;
+	do {
+		if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		File f;
+		f.written = found.ftLastWriteTime;
+		f.size = (static_cast<t_uint64>(found.nFileSizeHigh) << 32) | found.nFileSizeLow;
+		f.name = found.cFileName;
+		files.push_back(f);
+		total += f.size;
+	} while (FindNextFileW(search, &found));
+	FindClose(search);
+
+	if (total <= maxBytes)
+		return;
+
+	std::sort(files.begin(), files.end());
+	for (std::vector<File>::const_iterator it = files.begin(); it != files.end() && total > maxBytes; ++it) {
+		if (DeleteFileW((directory + L"\\" + it->name).c_str()))
+			total -= it->size;
+	}
+}
+
+bool ImageCache::contains(const byte *id) {
+	const std::string k = key(id);
+	{
+		LockedCS lock(cs);
+		if (index.find(k) != index.end())
+			return true;
+	}
+	return !directory.empty() && GetFileAttributesW(pathOf(k).c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+album_art_data::ptr ImageCache::get(const byte *id, const Fetch &fetch, abort_callback &p_abort, ImageRequest request) {
+	return lookup(key(id), fetch, p_abort, request, false);
+}
+
+album_art_data::ptr ImageCache::getThumbnail(const byte *id, unsigned maxPx, const Fetch &fetch, abort_callback &p_abort, ImageRequest request) {
+	const std::string source = key(id);
+	pfc::string8 k;
+	k << source.c_str() << "-" << maxPx;
+
+	return lookup(k.get_ptr(), [this, &source, &fetch, maxPx](abort_callback &a) -> album_art_data::ptr {
+		const album_art_data::ptr image = lookup(source, fetch, a, IMAGE_SOURCE, false);
+		if (image.is_empty())
+			return image;
+
+		InterlockedIncrement64(&thumbnails);
+		const album_art_data::ptr thumbnail = makeThumbnail(image, maxPx);
+		// Better the whole image than none, if it couldn't be scaled.
+		return thumbnail.is_valid() ? thumbnail : image;
+	}, p_abort, request, true);
+}
+
+album_art_data::ptr ImageCache::lookup(const std::string &k, const Fetch &fetch, abort_callback &p_abort, ImageRequest request, bool derived) {
+	if (IMAGE_WANTED == request)
+		InterlockedIncrement64(&wanted);
+
+	while (true) {
+		std::shared_ptr<Pending> mine;
+		std::shared_ptr<Pending> theirs;
+		{
+			LockedCS lock(cs);
+			album_art_data::ptr data = findInMemory(k);
+			if (data.is_valid()) {
+				InterlockedIncrement64(&memoryHits);
+				if (IMAGE_WANTED == request)
+					InterlockedIncrement64(&wantedHits);
+				return data;
+			}
+
+			std::map<std::string, std::shared_ptr<Pending> >::iterator it = pending.find(k);
+			if (it != pending.end()) {
+				theirs = it->second;
+			}
+			else {
+				mine = std::make_shared<Pending>();
+				pending[k] = mine;
+			}
+		}
+
+		if (theirs) {
+			theirs->done.wait(p_abort);
+			if (theirs->failed)
+				continue;
+			return theirs->result;
+		}
+
+		try {
+			album_art_data::ptr data = readFile(k);
+			if (data.is_valid()) {
+				InterlockedIncrement64(&diskHits);
+				if (IMAGE_WANTED == request)
+					InterlockedIncrement64(&wantedHits);
+			}
+			else {
+				if (!derived)
+					InterlockedIncrement64(IMAGE_PREFETCH == request ? &prefetches : &fetches);
+				data = fetch(p_abort);
+				if (data.is_valid()) {
+					if (!derived)
+						InterlockedAdd64(&fetchedBytes, data->get_size());
+					writeFile(k, data);
+				}
+			}
+			mine->result = data;
+		}
+		catch (...) {
+			mine->failed = true;
+			finish(k, *mine, request);
+			throw;
+		}
+
+		finish(k, *mine, request);
+		return mine->result;
+	}
+}
+
+/** Publishes the outcome of a fetch and wakes up whoever is waiting for it.
+ * Images only fetched to be scaled down stay out of memory; the thumbnail is what will be asked for again. */
+void ImageCache::finish(const std::string &key, Pending &fetch, ImageRequest request) {
+	{
+		LockedCS lock(cs);
+		if (fetch.result.is_valid() && request != IMAGE_SOURCE)
+			remember(key, fetch.result);
+		pending.erase(key);
+	}
+	SetEvent(fetch.done.handle);
+}
+
+void ImageCache::report() {
+	console::formatter() << "spotify images: " << memoryHits << " from memory, " << diskHits << " from disk, "
+		<< fetches << " fetched, " << prefetches << " prefetched (" << (fetchedBytes / 1024) << " KB), "
+		<< thumbnails << " thumbnails made";
+}
+
+void ImageCache::reportHitRate() {
+	const LONG64 nowWanted = wanted;
+	const LONG64 nowHits = wantedHits;
+	const LONG64 requests = nowWanted - reportedWanted;
+	const LONG64 hits = nowHits - reportedWantedHits;
+	reportedWanted = nowWanted;
+	reportedWantedHits = nowHits;
+
+	if (requests > 0) {
+		LogFormatter(LOG_ALBUM_ART) << hits << " of " << requests << " images since the last track were cached ("
+			<< (100 * hits / requests) << "%)";
+	}
+}
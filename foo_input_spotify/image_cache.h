@@ -0,0 +1,91 @@
+#pragma once
+
+#include "util.h"
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+/** Who an image is for; only what's wanted counts towards the hit rate. */
+enum ImageRequest {
+	IMAGE_WANTED,
+	IMAGE_PREFETCH,
+	/** To be scaled down for a thumbnail, which is what's counted. */
+	IMAGE_SOURCE,
+};
+
+/** Album art by Spotify image id, which identifies the image's content.
+ * Recently used images are kept in memory, up to the configured size; every image fetched is also kept on disk,
+ * one file per id, under images\ in the cache directory, trimmed to the configured size on open.
+ * Thumbnails are a tier of their own: scaled down once, then kept alongside, as small JPEGs.
+ * Concurrent requests for the same image share one fetch.
+ */
+class ImageCache : boost::noncopyable {
+public:
+	static const size_t ID_SIZE = 20;
+
+	typedef std::function<album_art_data::ptr (abort_callback &)> Fetch;
+
+	ImageCache();
+
+	void open(const std::wstring &directory);
+
+	/** The image with the given id, from the cache if possible, otherwise from fetch (null for no image).
+	 * Don't hold the spotify lock; fetch takes it as needed. */
+	album_art_data::ptr get(const byte *id, const Fetch &fetch, abort_callback &p_abort, ImageRequest request = IMAGE_WANTED);
+	/** The image with the given id scaled down to fit maxPx by maxPx; the image goes through get() first. */
+	album_art_data::ptr getThumbnail(const byte *id, unsigned maxPx, const Fetch &fetch, abort_callback &p_abort, ImageRequest request = IMAGE_WANTED);
+	/** Whether the image is cached, in memory or on disk; never waits for a fetch. */
+	bool contains(const byte *id);
+
+	/** Logs hits and fetches to the console. */
+	void report();
+	/** Logs how many of the images wanted since the last call were already cached; main thread only. */
+	void reportHitRate();
+
+private:
+	struct Pending {
+		Event done;
+		album_art_data::ptr result;
+		/** The fetch threw (most likely aborted), rather than finding no image; waiters try themselves. */
+		bool failed;
+
+		Pending() : done(TRUE, FALSE), failed(false) {
+		}
+	};
+
+	typedef std::list<std::pair<std::string, album_art_data::ptr> > Lru;
+
+	CriticalSection cs;
+	/** Most recently used first. */
+	Lru lru;
+	std::map<std::string, Lru::iterator> index;
+	size_t memoryBytes;
+	std::map<std::string, std::shared_ptr<Pending> > pending;
+	std::wstring directory;
+
+	volatile LONG64 memoryHits;
+	volatile LONG64 diskHits;
+	volatile LONG64 fetches;
+	volatile LONG64 prefetches;
+	volatile LONG64 fetchedBytes;
+	volatile LONG64 thumbnails;
+	/** IMAGE_WANTED requests, and how many of them were cached. */
+	volatile LONG64 wanted;
+	volatile LONG64 wantedHits;
+	/** Main thread only. */
+	LONG64 reportedWanted;
+	LONG64 reportedWantedHits;
+
+	static std::string key(const byte *id);
+	/** @param derived whether fetch makes it from another image, rather than downloading it. */
+	album_art_data::ptr lookup(const std::string &key, const Fetch &fetch, abort_callback &p_abort, ImageRequest request, bool derived);
+	std::wstring pathOf(const std::string &key) const;
+	album_art_data::ptr findInMemory(const std::string &key);
+	void remember(const std::string &key, const album_art_data::ptr &data);
+	album_art_data::ptr readFile(const std::string &key);
+	void writeFile(const std::string &key, const album_art_data::ptr &data);
+	void trim(t_uint64 maxBytes);
+	void finish(const std::string &key, Pending &fetch, ImageRequest request);
+};
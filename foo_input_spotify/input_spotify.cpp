@@ -3,6 +3,7 @@
 #include "util.h"
 
 #include "../helpers/dropdown_helper.h"
+#include <algorithm>
 #include <functional>
 #include <shlobj.h>
 
@@ -12,183 +13,239 @@
 
 #include "SpotifySession.h"
 #include "SpotifyPlusPlus.h"
+#include "config.h"
+#include "log_ring.h"
+#include "resolved_link.h"
 
 extern "C" {
 	extern const uint8_t g_appkey[];
 	extern const size_t g_appkey_size;
 }
 
-template <typename T>
-void CALLBACK notifyEvent(T *result, void *userdata) {
-	HANDLE ev = userdata;
-	SetEvent(ev);
-	CloseHandle(ev);
-}
-
 class InputSpotify
 {
 	t_filestats m_stats;
 
 	std::string url;
-	std::vector<SpotifyTrackPtr> t;
-	typedef std::vector<SpotifyTrackPtr>::iterator tr_iter;
+	/** Shared with the session's link cache, and other instances opened on the same link. */
+	std::shared_ptr<ResolvedLink> m_link;
+	t_uint32 m_trackCount;
 
 	int channels;
 	int sampleRate;
 
-#define FOR_TRACKS() for (tr_iter it = t.begin(); it != t.end(); ++it)
+	t_int32 m_subsong;
+	int m_durationMs;
+	double m_position;
+	bool m_prefetched;
+	/** Anything but playback (converter, ReplayGain scan...) decodes as fast as libspotify delivers. */
+	DecoderPriority m_priority;
+	DWORD m_decodeStartedAt;
 
-	void freeTracks() {
-		t.clear();
-	}
+	/** Upper bound for a decoded chunk; keeps the chunk's sample buffer at a fixed size once grown. */
+	static const size_t MAX_CHUNK_SAMPLES = 8192;
 
-	SpotifySession &ss;
-
-public:
+	static bool isLazy(int count) {
+		return static_cast<t_uint64>(count) > cfg_lazy_track_threshold.get();
+	}
 
-	InputSpotify() : ss(SpotifySession::instance()) {
+	/** Session thread only; see SpotifySession::call(). Keep the result for as long as the track is used. */
+	SpotifyTrackPtr trackAt(t_uint32 subsong) {
+		if (!m_link)
+			throw exception_io_data("no such subsong");
+		return m_link->trackAt(subsong);
 	}
 
-	~InputSpotify() {
-		freeTracks();
-		ss.releaseDecoder(this);
+	/** For tracks open() didn't wait for: lazily enumerated ones, and ones served from the metadata cache.
+	 * Not on the session thread; the caller holds a reference to the track, see trackAt(). */
+	void awaitTrackLoaded(sp_track *track, abort_callback &p_abort) {
+		ss.awaitTracksLoaded(std::vector<sp_track *>(1, track), p_abort);
 	}
 
-	void open( service_ptr_t<file> m_file, const char * p_path, t_input_open_reason p_reason, abort_callback & p_abort )
+	/** Enumerates what uri points to, with the lock held (dropped while waiting).
+	 * @return the playlist whose changes should invalidate the cached result, or NULL. */
+	static sp_playlist *resolve(ResolvedLink &resolved, sp_session *sess, const char *uri, LockedCS &lock, abort_callback &p_abort)
 	{
-		if ( p_reason == input_open_info_write ) throw exception_io_denied_readonly();
-		url = p_path;
+		SpotifyLinkPtr link;
+		link.Attach(sp_link_create_from_string(uri));
+		if (!link)
+			throw exception_io_data("couldn't parse url");
 
-		sp_session *sess = ss.get(p_abort);
-		switch (sp_session_connectionstate(sess))
-		{
-		case SP_CONNECTION_STATE_LOGGED_IN:
-		case SP_CONNECTION_STATE_OFFLINE:
-			break;
-		default:
-			throw exception_io_denied("could not log in to Spotify");
-		}
+		sp_playlist *watch = NULL;
 
-		{
-			LockedCS lock(ss.getSpotifyCS());
+		switch(sp_link_type(link)) {
+			case SP_LINKTYPE_ALBUM: {
+				SpotifyFuture<sp_albumbrowse> future = SpotifyAlbumBrowseAsync(sess, sp_link_as_album(link));
+				sp_albumbrowse *browse = future.Get(lock, p_abort);
 
-			SpotifyLinkPtr link;
-			link.Attach(sp_link_create_from_string(p_path));
-			if (!link)
-				throw exception_io_data("couldn't parse url");
+				const int count = browse ? sp_albumbrowse_num_tracks(browse) : 0;
+				if (0 == count)
+					throw exception_io_data("empty (or failed to load?) album");
 
-			freeTracks();
+				for (int i = 0; i < count; ++i) {
+					SpotifyTrackPtr track = sp_albumbrowse_track(browse, i);
+					resolved.tracks.push_back(track);
+				}
+			} break;
 
-			switch(sp_link_type(link)) {
-				case SP_LINKTYPE_ALBUM: {
-					SpotifyAlbumPtr album = sp_link_as_album(link);
+			case SP_LINKTYPE_PLAYLIST: {
+				SpotifyFuture<sp_playlist> future = SpotifyPlaylistAsync(sess, link);
+				sp_playlist *playlist = future.Get(lock, p_abort);
 
-					Event ev(false, false);
-					SpotifyAlbumBrowsePtr browse = sp_albumbrowse_create(sess, album, &notifyEvent, ev.duplicateHandle());
+				int count = playlist ? sp_playlist_num_tracks(playlist) : 0;
+				if (0 == count)
+					throw exception_io_data("empty (or failed to load?) playlist");
 
-					while (!sp_albumbrowse_is_loaded(browse)) {
-						lock.waitForEvent(ev, p_abort);
-					}
+				resolved.playlist = playlist;
+				watch = playlist;
 
-					const int count = sp_albumbrowse_num_tracks(browse);
-					if (0 == count)
-						throw exception_io_data("empty (or failed to load?) album");
+				if (isLazy(count)) {
+					resolved.trackCount = count;
+					break;
+				}
 
-					for (int i = 0; i < count; ++i) {
-						SpotifyTrackPtr track = sp_albumbrowse_track(browse, i);
-						t.push_back(track);
-					}
-				} break;
+				for (int i = 0; i < count; ++i) {
+					SpotifyTrackPtr track = sp_playlist_track(playlist, i);
+					resolved.tracks.push_back(track);
+				}
+			} break;
 
-				case SP_LINKTYPE_PLAYLIST: {
-					SpotifyPlaylistPtr playlist;
-					playlist.Attach(sp_playlist_create(sess, link));
+			case SP_LINKTYPE_ARTIST: {
+				SpotifyFuture<sp_artistbrowse> future = SpotifyArtistBrowseAsync(sess, sp_link_as_artist(link), SP_ARTISTBROWSE_FULL);
+				sp_artistbrowse *browse = future.Get(lock, p_abort);
 
-					SpotifyAwaitLoaded(playlist.m_ptr, lock, p_abort);
+				const int count = browse ? sp_artistbrowse_num_tracks(browse) : 0;
+				if (0 == count)
+					throw exception_io_data("empty (or failed to load?) artist");
 
-					int count = sp_playlist_num_tracks(playlist);
-					if (0 == count)
-						throw exception_io_data("empty (or failed to load?) playlist");
+				if (isLazy(count)) {
+					resolved.artistBrowse = browse;
+					resolved.trackCount = count;
+					break;
+				}
 
-					for (int i = 0; i < count; ++i) {
-						SpotifyTrackPtr track = sp_playlist_track(playlist, i);
-						t.push_back(track);
-					}
-				} break;
+				for (int i = 0; i < count; ++i) {
+					SpotifyTrackPtr track = sp_artistbrowse_track(browse, i);
+					resolved.tracks.push_back(track);
+				}
+			} break;
 
-				case SP_LINKTYPE_ARTIST: {
-					SpotifyArtistPtr artist = sp_link_as_artist(link);
+			case SP_LINKTYPE_SEARCH: {
+				std::string query = uri;
+				query = query.substr(15, sizeof(uri) - 15);
 
-					Event ev(false, false);
-					SpotifyArtistBrowsePtr browse;
-					browse.Attach(sp_artistbrowse_create(sess, sp_link_as_artist(link), SP_ARTISTBROWSE_FULL, &notifyEvent, ev.duplicateHandle()));
+				// spotify:search:
 
-					while (!sp_artistbrowse_is_loaded(browse)) {
-						lock.waitForEvent(ev, p_abort);
-					}
+				SpotifyFuture<sp_search> future = SpotifySearchAsync(sess, query.c_str(), 0, 200, 0, 10, 0, 10, 0, 20, SP_SEARCH_SUGGEST);
+				sp_search *browse = future.Get(lock, p_abort);
 
-					const int count = sp_artistbrowse_num_tracks(browse);
-					if (0 == count)
-						throw exception_io_data("empty (or failed to load?) artist");
+				const int count = browse ? sp_search_num_tracks(browse) : 0;
+				if (0 == count)
+					throw exception_io_data("empty (or failed to load?) search");
 
-					for (int i = 0; i < count; ++i) {
-						SpotifyTrackPtr track = sp_artistbrowse_track(browse, i);
-						t.push_back(track);
-					}
-				} break;
+				for (int i = 0; i < count; ++i) {
+					SpotifyTrackPtr track = sp_search_track(browse, i);
+					resolved.tracks.push_back(track);
+				}
+			} break;
 
-				case SP_LINKTYPE_SEARCH: {
-					std::string query = p_path;
-					query = query.substr(15, sizeof(p_path) - 15);
+			case SP_LINKTYPE_TRACK: {
+				SpotifyTrackPtr ptr = sp_link_as_track(link);
+				resolved.tracks.push_back(ptr);
+			} break;
 
-					// spotify:search:
+			default:
+				throw exception_io_data("Only artist, track, playlist and album URIs are supported");
+		}
 
-					Event ev(false, false);
-					SpotifySearchPtr browse;
-					browse.Attach(sp_search_create(sess, query.c_str(), 0, 200, 0, 10, 0, 10, 0, 20, SP_SEARCH_SUGGEST, &notifyEvent, ev.duplicateHandle()));
+		if (!resolved.tracks.empty())
+			resolved.trackCount = static_cast<t_uint32>(resolved.tracks.size());
+		return watch;
+	}
 
-					while (!sp_search_is_loaded(browse)) {
-						lock.waitForEvent(ev, p_abort);
-					}
+	SpotifySession &ss;
 
-					const int count = sp_search_num_tracks(browse);
-					if (0 == count)
-						throw exception_io_data("empty (or failed to load?) search");
+public:
 
-					for (int i = 0; i < count; ++i) {
-						SpotifyTrackPtr track = sp_search_track(browse, i);
-						t.push_back(track);
-					}
-				} break;
+	InputSpotify() : m_trackCount(0), m_subsong(0), m_durationMs(0), m_position(0), m_prefetched(false),
+			m_priority(DECODER_PLAYBACK), m_decodeStartedAt(0), ss(SpotifySession::instance()) {
+	}
 
-				case SP_LINKTYPE_TRACK: {
-					SpotifyTrackPtr ptr = sp_link_as_track(link);
-					t.push_back(ptr);
-				} break;
+	~InputSpotify() {
+		ss.releaseDecoder(this);
+	}
 
-				default:
-					throw exception_io_data("Only artist, track, playlist and album URIs are supported");
-			}
+	void open( service_ptr_t<file> m_file, const char * p_path, t_input_open_reason p_reason, abort_callback & p_abort )
+	{
+		if ( p_reason == input_open_info_write ) throw exception_io_denied_readonly();
+		url = p_path;
+
+		sp_session *sess = ss.get(p_abort);
+		switch (sp_session_connectionstate(sess))
+		{
+		case SP_CONNECTION_STATE_LOGGED_IN:
+		case SP_CONNECTION_STATE_OFFLINE:
+			break;
+		default:
+			throw exception_io_denied("could not log in to Spotify");
 		}
 
-		while (true) {
-			{
-				LockedCS lock(ss.getSpotifyCS());
-				size_t done = 0;
-				FOR_TRACKS() {
-					const sp_error e = sp_track_error(*it);
-					if (SP_ERROR_OK == e)
-						++done;
-					else if (SP_ERROR_IS_LOADING != e)
-						assertSucceeds("preloading track", e);
-				}
+		DECLARE_LOCK_SITE(site);
+		LockedCS lock(ss.getSpotifyCS(), site);
 
-				if (done == t.size())
-					break;
-			}
+		// foobar2000 opens every subsong afresh; reuse what the link resolved to last time, unless it changed since.
+		m_link = ss.findResolvedLink(url);
+		if (!m_link) {
+			m_link = std::make_shared<ResolvedLink>();
+			sp_playlist *watch = resolve(*m_link, sess, p_path, lock, p_abort);
+			ss.storeResolvedLink(url, m_link, watch);
+		}
+		m_trackCount = m_link->trackCount;
+
+		if (m_link->loaded)
+			return;
+
+		std::vector<sp_track *> pending;
+		for (size_t i = 0; i < m_link->tracks.size(); ++i) {
+			// Tracks known to the metadata cache needn't hold up opening; get_info is served from the cache.
+			if (!ss.metadataCache.contains(trackUri(m_link->tracks[i])))
+				pending.push_back(m_link->tracks[i]);
+		}
 
-			p_abort.sleep(0.05);
+		// Joins every other open() waiting on tracks; the session thread checks all of them in one pass per update.
+		ss.awaitTracksLoaded(lock, pending, p_abort);
+		awaitAlbumsAndArtists(pending, lock, p_abort);
+		m_link->loaded = true;
+	}
+
+	/** get_info reads the names of the tracks' albums and artists, which may still be loading after the tracks are;
+	 * loads them all at once. With the lock held (dropped while waiting). */
+	static void awaitAlbumsAndArtists(const std::vector<sp_track *> &tracks, LockedCS &lock, abort_callback &p_abort)
+	{
+		std::vector<sp_album *> albumPtrs;
+		std::vector<sp_artist *> artistPtrs;
+		for (size_t i = 0; i < tracks.size(); ++i) {
+			albumPtrs.push_back(sp_track_album(tracks[i]));
+			const int artistCount = sp_track_num_artists(tracks[i]);
+			for (int a = 0; a < artistCount; ++a)
+				artistPtrs.push_back(sp_track_artist(tracks[i], a));
 		}
+		std::sort(albumPtrs.begin(), albumPtrs.end());
+		albumPtrs.erase(std::unique(albumPtrs.begin(), albumPtrs.end()), albumPtrs.end());
+		std::sort(artistPtrs.begin(), artistPtrs.end());
+		artistPtrs.erase(std::unique(artistPtrs.begin(), artistPtrs.end()), artistPtrs.end());
+
+		std::vector<SpotifyFuture<sp_album> > albums;
+		albums.reserve(albumPtrs.size());
+		for (size_t i = 0; i < albumPtrs.size(); ++i)
+			albums.emplace_back(albumPtrs[i]);
+		std::vector<SpotifyFuture<sp_artist> > artists;
+		artists.reserve(artistPtrs.size());
+		for (size_t i = 0; i < artistPtrs.size(); ++i)
+			artists.emplace_back(artistPtrs[i]);
+
+		SpotifyWhenAll(albums.begin(), albums.end(), lock, p_abort);
+		SpotifyWhenAll(artists.begin(), artists.end(), lock, p_abort);
 	}
 
 	void meta_add_if_positive(file_info &p_info, const char * p_name, int p_value)
@@ -198,21 +255,64 @@ public:
 		}
 	}
 
-	void get_info(t_int32 subsong, file_info & p_info, abort_callback & p_abort )
+	/** Requires the spotify lock (or the session thread). */
+	static std::string trackUri(sp_track *track)
 	{
-		LockedCS lock(ss.getSpotifyCS());
-		sp_track *tr = t.at(subsong);
-		p_info.set_length(sp_track_duration(tr)/1000.0);
+		SpotifyLinkPtr link;
+		link.Attach(sp_link_create_from_track(track, 0));
+
+		char uri[256];
+		if (!link || sp_link_as_string(link, uri, sizeof(uri)) <= 0)
+			return std::string();
+		return uri;
+	}
+
+	/** Requires the spotify lock (or the session thread) and a loaded track. */
+	static void readMetadata(sp_track *tr, TrackMetadata &meta)
+	{
+		meta.durationMs = sp_track_duration(tr);
 		const int artist_count = sp_track_num_artists(tr);
 		for (int artist_index = 0; artist_index < artist_count; ++artist_index) {
-			p_info.meta_add("ARTIST", sp_artist_name(sp_track_artist(tr, artist_index)));
+			meta.artists.push_back(sp_artist_name(sp_track_artist(tr, artist_index)));
+		}
+		meta.albumArtist = sp_artist_name(sp_album_artist(sp_track_album(tr)));
+		meta.album = sp_album_name(sp_track_album(tr));
+		meta.title = sp_track_name(tr);
+		meta.trackNumber = sp_track_index(tr);
+		meta.discNumber = sp_track_disc(tr);
+		meta.year = sp_album_year(sp_track_album(tr));
+	}
+
+	void get_info(t_int32 subsong, file_info & p_info, abort_callback & p_abort )
+	{
+		TrackMetadata meta;
+		SpotifyTrackPtr track;
+
+		// libspotify is only touched on the session thread, so this never contends with it for the lock.
+		// The track is captured by reference: copying it here would take the lock for the reference.
+		const std::string uri = ss.call([this, subsong, &track](sp_session *) {
+			track = trackAt(subsong);
+			return trackUri(track);
+		}, p_abort);
+
+		if (!ss.metadataCache.lookup(uri, meta)) {
+			awaitTrackLoaded(track, p_abort);
+			ss.call([&track, &meta](sp_session *) {
+				readMetadata(track, meta);
+			}, p_abort);
+			ss.metadataCache.store(uri, meta);
 		}
-		p_info.meta_add("ALBUM ARTIST", sp_artist_name(sp_album_artist(sp_track_album(tr))));
-		p_info.meta_add("ALBUM", sp_album_name(sp_track_album(tr)));
-		p_info.meta_add("TITLE", sp_track_name(tr));
-		meta_add_if_positive(p_info, "TRACKNUMBER", sp_track_index(tr));
-		meta_add_if_positive(p_info, "DISCNUMBER", sp_track_disc(tr));
-		meta_add_if_positive(p_info, "DATE", sp_album_year(sp_track_album(tr)));
+
+		p_info.set_length(meta.durationMs/1000.0);
+		for (std::vector<std::string>::const_iterator it = meta.artists.begin(); it != meta.artists.end(); ++it) {
+			p_info.meta_add("ARTIST", it->c_str());
+		}
+		p_info.meta_add("ALBUM ARTIST", meta.albumArtist.c_str());
+		p_info.meta_add("ALBUM", meta.album.c_str());
+		p_info.meta_add("TITLE", meta.title.c_str());
+		meta_add_if_positive(p_info, "TRACKNUMBER", meta.trackNumber);
+		meta_add_if_positive(p_info, "DISCNUMBER", meta.discNumber);
+		meta_add_if_positive(p_info, "DATE", meta.year);
 	}
 
 	t_filestats get_file_stats( abort_callback & p_abort )
@@ -222,43 +322,140 @@ public:
 
 	void decode_initialize(t_int32 subsong, unsigned p_flags, abort_callback & p_abort )
 	{
-		if ((p_flags & input_flag_playback) == 0)
-			throw exception_io_denied();
+		// There's only the one player. Whoever may seek is taken to be someone listening, ahead of a plain sequential read.
+		if (p_flags & input_flag_playback)
+			m_priority = DECODER_PLAYBACK;
+		else if (p_flags & input_flag_no_seeking)
+			m_priority = DECODER_BACKGROUND;
+		else
+			m_priority = DECODER_PREVIEW;
+		const bool handedOver = ss.takeDecoder(this, m_priority, p_abort);
+
+		m_subsong = subsong;
+		m_position = 0;
+		m_prefetched = false;
+
+		loadTrack(0, handedOver, p_abort);
+		m_decodeStartedAt = GetTickCount();
+	}
 
-		ss.takeDecoder(this);
+	/** Starts the player on m_subsong, from offsetMs in. Requires the decoder.
+	 * @param unload whether the player may still be on someone else's track, which mustn't deliver any more. */
+	void loadTrack(int offsetMs, bool unload, abort_callback & p_abort)
+	{
+		ss.buf.setTarget(static_cast<int>(cfg_buffer_ms.get()), cfg_buffer_adaptive);
+		ss.buf.setRealtime(DECODER_PLAYBACK == m_priority);
+		ss.get(p_abort);
+
+		// Player calls and metadata go through the session thread rather than contending with it for the lock.
+		SpotifyTrackPtr track = ss.call([this](sp_session *) {
+			return trackAt(m_subsong);
+		}, p_abort);
+		awaitTrackLoaded(track, p_abort);
+
+		// We're blocked here meanwhile, so the session thread may flush the ring on our behalf:
+		// only once the old track is unloaded can none of its audio follow.
+		ss.call([this, &track, offsetMs, unload](sp_session *sess) {
+			m_durationMs = sp_track_duration(track);
+			if (unload)
+				sp_session_player_unload(sess);
+			ss.buf.flush();
+			assertSucceeds("load track (including region check)", sp_session_player_load(sess, track));
+			if (offsetMs > 0)
+				sp_session_player_seek(sess, offsetMs);
+			sp_session_player_play(sess, 1);
+		}, p_abort);
+	}
 
-		ss.buf.flush();
-		sp_session *sess = ss.get(p_abort);
+	/** Someone more important wanted the player. Background decoding carries on from where it was once they're done;
+	 * playback and previews have been superseded, and give up. */
+	void onPreempted(abort_callback & p_abort)
+	{
+		if (DECODER_BACKGROUND != m_priority) {
+			ss.releaseDecoder(this);
+			throw exception_io_data("Spotify player was taken over by another track");
+		}
 
-		LockedCS lock(ss.getSpotifyCS());
-		assertSucceeds("load track (including region check)", sp_session_player_load(sess, t.at(subsong)));
-		sp_session_player_play(sess, 1);
+		const bool handedOver = ss.yieldDecoder(this, m_priority, p_abort);
+		loadTrack(static_cast<int>(m_position * 1000), handedOver, p_abort);
 	}
 
-	bool decode_run( audio_chunk & p_chunk, abort_callback & p_abort )
+	void reportDecodeSpeed()
 	{
-		ss.ensureDecoder(this);
+		const double elapsed = (GetTickCount() - m_decodeStartedAt) / 1000.0;
+		if (elapsed <= 0)
+			return;
+		LogFormatter(LOG_PLAYBACK) << "decoded " << pfc::format_float(m_position, 0, 1) << " s of audio in "
+			<< pfc::format_float(elapsed, 0, 1) << " s (" << pfc::format_float(m_position / elapsed, 0, 1) << "x realtime)";
+	}
+
+	/** Lets libspotify start fetching the next subsong once we're close enough to the end of this one. */
+	void prefetchNextIfDue(abort_callback & p_abort)
+	{
+		if (DECODER_PLAYBACK != m_priority || m_prefetched || static_cast<t_uint32>(m_subsong) + 1 >= m_trackCount)
+			return;
 
-		Gentry *e = ss.buf.take(&p_abort);
+		if (m_position * 1000 < m_durationMs - cfg_prefetch_seconds.get() * 1000.0)
+			return;
 
-		if (NULL == e->data) {
-			ss.buf.free(e);
-			ss.releaseDecoder(this);
+		m_prefetched = true;
+
+		// Runs on the session thread, which holds the lock for trackAt.
+		const t_int32 next = m_subsong + 1;
+		ss.call([this, next](sp_session *sess) {
+			// The playlist may have lost the next track since; that's for its own open to report.
+			try {
+				sp_session_player_prefetch(sess, trackAt(next));
+			}
+			catch (exception_io_not_found &) {
+			}
+		}, p_abort);
+	}
+
+	bool decode_run( audio_chunk & p_chunk, abort_callback & p_abort )
+	{
+		const int16_t *data;
+		size_t size;
+		PcmFormat format;
+
+		PcmRing::ReadResult result;
+		do {
+			if (ss.isPreempted(this))
+				onPreempted(p_abort);
+			ss.ensureDecoder(this);
+			result = ss.buf.read(data, size, format, p_abort);
+		} while (PcmRing::READ_INTERRUPTED == result);
+
+		if (PcmRing::READ_END_OF_TRACK == result) {
+			if (DECODER_PLAYBACK != m_priority)
+				reportDecodeSpeed();
+
+			// Hang on to the player if the next subsong is already prefetched, so we can go straight on to it.
+			if (m_prefetched)
+				ss.lingerDecoder(this);
+			else
+				ss.releaseDecoder(this);
 			return false;
 		}
 
-		p_chunk.set_data_fixedpoint(
-			e->data,
-			e->size,
-			e->sampleRate,
-			e->channels,
-			16,
-			audio_chunk::channel_config_stereo);
+		// Convert straight out of the ring; the chunk only ever grows to MAX_CHUNK_SAMPLES,
+		// so steady state playback doesn't allocate.
+		const size_t frameSamples = format.channels;
+		const size_t samples = pfc::min_t<size_t>(size / sizeof(int16_t), MAX_CHUNK_SAMPLES / frameSamples * frameSamples);
 
-		channels = e->channels;
-		sampleRate = e->sampleRate;
+		p_chunk.grow_data_size(MAX_CHUNK_SAMPLES);
+		audio_math::convert_from_int16(data, samples, p_chunk.get_data(), 1.0);
+		p_chunk.set_sample_count(samples / frameSamples);
+		p_chunk.set_srate(format.sampleRate);
+		p_chunk.set_channels(format.channels, audio_chunk::g_guess_channel_config(format.channels));
 
-		ss.buf.free(e);
+		channels = format.channels;
+		sampleRate = format.sampleRate;
+
+		ss.buf.consume(samples * sizeof(int16_t));
+
+		m_position += static_cast<double>(samples / frameSamples) / format.sampleRate;
+		prefetchNextIfDue(p_abort);
 
 		return true;
 	}
@@ -267,10 +464,15 @@ public:
 	{
 		ss.ensureDecoder(this);
 
-		ss.buf.flush();
-		sp_session *sess = ss.get(p_abort);
-		LockedCS lock(ss.getSpotifyCS());
-		sp_session_player_seek(sess, static_cast<int>(p_seconds*1000));
+		ss.get(p_abort);
+		const int offsetMs = static_cast<int>(p_seconds*1000);
+		// As in loadTrack: flush once nothing from before the seek can be delivered any more.
+		ss.call([this, offsetMs](sp_session *sess) {
+			sp_session_player_seek(sess, offsetMs);
+			ss.buf.flush();
+		}, p_abort);
+
+		m_position = p_seconds;
 	}
 
 	bool decode_can_seek()
@@ -292,6 +494,31 @@ public:
 
 	void decode_on_idle( abort_callback & p_abort ) { }
 
+	bool decode_run_raw( audio_chunk & p_chunk, mem_block_container & p_raw, abort_callback & p_abort )
+	{
+		throw pfc::exception_not_implemented();
+	}
+
+	void set_logger( event_logger::ptr ptr ) { }
+
+	/** Pauses libspotify itself, so it stops delivering (and streaming) rather than being refused by a full buffer. */
+	void set_pause( bool paused )
+	{
+		if (!ss.hasDecoder(this))
+			return;
+
+		abort_callback_dummy noAbort;
+		ss.call([paused](sp_session *sess) {
+			sp_session_player_play(sess, paused ? 0 : 1);
+		}, noAbort);
+	}
+
+	/** What's buffered is still exactly where playback left off, so there's no need to throw it away. */
+	bool flush_on_pause()
+	{
+		return false;
+	}
+
 	void retag_set_info( t_int32 subsong, const file_info & p_info, abort_callback & p_abort )
 	{
 		throw exception_io_data();
@@ -313,7 +540,7 @@ public:
 	}
 
 	t_uint32 get_subsong_count() {
-		return t.size();
+		return m_trackCount;
 	}
 
 	t_uint32 get_subsong(t_uint32 song) {
@@ -321,6 +548,6 @@ public:
 	}
 };
 
-static input_factory_t< InputSpotify > inputFactorySpotify;
+static input_factory_ex_t< InputSpotify, 0, input_decoder_v3 > inputFactorySpotify;
 
 DECLARE_COMPONENT_VERSION("Spotify Decoder", MYVERSION, "Support for spotify: urls.");
@@ -0,0 +1,175 @@
+#include "pch.h"
+
+#include "log_ring.h"
+#include "config.h"
+
+namespace {
+	const char *const CATEGORY_NAMES[LOG_CATEGORY_COUNT] = { "spotify log", "spotify", "spotify", "spotify album art" };
+}
+
+LogRing &LogRing::instance() {
+	static LogRing ring;
+
+	return ring;
+}
+
+LogRing::LogRing() : enqueuePos(0), dequeuePos(0), writerWaiting(false), stopping(false), recordsAvailable(FALSE, FALSE),
+		thread(NULL), dropped(0), reportedDropped(0), file(INVALID_HANDLE_VALUE) {
+	for (size_t i = 0; i < CAPACITY; ++i)
+		records[i].sequence.store(i, std::memory_order_relaxed);
+
+	for (int i = 0; i < LOG_CATEGORY_COUNT; ++i) {
+		windowStart[i] = 0;
+		windowCount[i] = 0;
+		suppressed[i] = 0;
+	}
+
+	thread = CreateThread(NULL, 0, &writerThread, this, 0, NULL);
+	if (thread != NULL)
+		SetThreadPriority(thread, THREAD_PRIORITY_LOWEST);
+}
+
+LogRing::~LogRing() {
+	if (thread != NULL)
+		CloseHandle(thread);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+void LogRing::write(LogCategory category, LogLevel level, const char *text) {
+	if (level < static_cast<LogLevel>(cfg_log_level.get()))
+		return;
+
+	size_t pos = enqueuePos.load(std::memory_order_relaxed);
+	Record *record;
+	while (true) {
+		record = &records[pos & (CAPACITY - 1)];
+		const size_t sequence = record->sequence.load(std::memory_order_acquire);
+		const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence - pos);
+		if (0 == diff) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			// Full: the writer thread is behind, or the console is slow. Never wait for it.
+			InterlockedIncrement64(&dropped);
+			return;
+		}
+		else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	record->category = category;
+	record->level = level;
+	strncpy_s(record->text, text, _TRUNCATE);
+	record->sequence.store(pos + 1, std::memory_order_release);
+
+	if (writerWaiting.exchange(false))
+		SetEvent(recordsAvailable.handle);
+}
+
+bool LogRing::pop(Record &out) {
+	Record &record = records[dequeuePos & (CAPACITY - 1)];
+	if (record.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+		return false;
+
+	out.category = record.category;
+	out.level = record.level;
+	memcpy(out.text, record.text, sizeof(out.text));
+	record.sequence.store(dequeuePos + CAPACITY, std::memory_order_release);
+	++dequeuePos;
+	return true;
+}
+
+void LogRing::output(const char *text) {
+	console::print(text);
+
+	if (INVALID_HANDLE_VALUE == file)
+		return;
+	DWORD written;
+	WriteFile(file, text, static_cast<DWORD>(strlen(text)), &written, NULL);
+	WriteFile(file, "\r\n", 2, &written, NULL);
+}
+
+/** Starts a new one second window for category once the last one is over, reporting what was suppressed in it. */
+void LogRing::nextWindow(int category, DWORD now) {
+	if (now - windowStart[category] < 1000)
+		return;
+
+	if (suppressed[category] > 0) {
+		output(pfc::string_formatter() << CATEGORY_NAMES[category] << ": " << suppressed[category] << " more messages suppressed");
+		suppressed[category] = 0;
+	}
+	windowStart[category] = now;
+	windowCount[category] = 0;
+}
+
+void LogRing::writeOut(const Record &record) {
+	const int category = record.category;
+	nextWindow(category, GetTickCount());
+
+	// Errors always get through.
+	if (++windowCount[category] > MAX_PER_SECOND && record.level < LOG_ERROR) {
+		++suppressed[category];
+		return;
+	}
+
+	output(pfc::string_formatter() << CATEGORY_NAMES[category] << ": " << record.text);
+}
+
+void LogRing::drain() {
+	pfc::string8 path;
+	cfg_log_file.get(path);
+	if (path != filePath) {
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		filePath = path;
+		if (!path.is_empty()) {
+			file = CreateFileW(pfc::stringcvt::string_wide_from_utf8(path), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		}
+	}
+
+	Record record;
+	while (pop(record))
+		writeOut(record);
+
+	const DWORD now = GetTickCount();
+	for (int category = 0; category < LOG_CATEGORY_COUNT; ++category)
+		nextWindow(category, now);
+
+	const LONG64 nowDropped = dropped;
+	if (nowDropped != reportedDropped) {
+		output(pfc::string_formatter() << "spotify log: " << (nowDropped - reportedDropped) << " messages dropped, the log queue was full");
+		reportedDropped = nowDropped;
+	}
+}
+
+DWORD WINAPI LogRing::writerThread(void *data) {
+	LogRing *ring = static_cast<LogRing *>(data);
+
+	while (!ring->stopping.load()) {
+		ring->drain();
+
+		ring->writerWaiting.store(true);
+		// Check again, for records written before we said we're waiting; the timeout is for suppressed counts.
+		const Record &next = ring->records[ring->dequeuePos & (CAPACITY - 1)];
+		if (next.sequence.load(std::memory_order_acquire) == ring->dequeuePos + 1) {
+			ring->writerWaiting.store(false);
+			continue;
+		}
+		WaitForSingleObject(ring->recordsAvailable.handle, 1000);
+	}
+
+	ring->drain();
+	return 0;
+}
+
+void LogRing::shutdown(DWORD budgetMs) {
+	if (stopping.exchange(true) || NULL == thread)
+		return;
+
+	SetEvent(recordsAvailable.handle);
+	WaitForSingleObject(thread, budgetMs);
+}
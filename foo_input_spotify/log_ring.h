@@ -0,0 +1,97 @@
+#pragma once
+
+#include "util.h"
+#include <atomic>
+
+/** Where a log record comes from; each is rate limited separately. */
+enum LogCategory {
+	LOG_LIBSPOTIFY,
+	LOG_SESSION,
+	LOG_PLAYBACK,
+	LOG_ALBUM_ART,
+	LOG_CATEGORY_COUNT,
+};
+
+enum LogLevel {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARNING,
+	LOG_ERROR,
+};
+
+/** A bounded, lock-free queue of preformatted log records, written out by a low priority thread
+ * to the console, and to a file if one is configured.
+ * write() never blocks or does any I/O, so it's fine from libspotify callbacks and with the spotify lock held.
+ * When the queue is full, records are dropped, and counted.
+ * Records below the configured level are dropped as they're written; rate limiting is up to the writer thread,
+ * which prints how many records of a category it suppressed once the category is quiet again.
+ */
+class LogRing : boost::noncopyable {
+public:
+	/** Must be a power of two. */
+	static const size_t CAPACITY = 256;
+	static const size_t MAX_TEXT = 240;
+	static const int MAX_PER_SECOND = 20;
+
+	static LogRing &instance();
+
+	void write(LogCategory category, LogLevel level, const char *text);
+
+	/** Writes out what's queued, and stops the writer thread; gives up on the writer after budgetMs. */
+	void shutdown(DWORD budgetMs);
+
+private:
+	struct Record {
+		/** Vyukov's bounded queue: equals the slot's position when it's free to write, position + 1 when written. */
+		std::atomic<size_t> sequence;
+		LogCategory category;
+		LogLevel level;
+		char text[MAX_TEXT];
+	};
+
+	Record records[CAPACITY];
+	std::atomic<size_t> enqueuePos;
+	/** Writer thread only. */
+	size_t dequeuePos;
+
+	std::atomic<bool> writerWaiting;
+	std::atomic<bool> stopping;
+	Event recordsAvailable;
+	HANDLE thread;
+
+	volatile LONG64 dropped;
+
+	// Writer thread only.
+	DWORD windowStart[LOG_CATEGORY_COUNT];
+	int windowCount[LOG_CATEGORY_COUNT];
+	int suppressed[LOG_CATEGORY_COUNT];
+	LONG64 reportedDropped;
+	HANDLE file;
+	pfc::string8 filePath;
+
+	LogRing();
+	~LogRing();
+
+	bool pop(Record &out);
+	void nextWindow(int category, DWORD now);
+	void writeOut(const Record &record);
+	void output(const char *text);
+	void drain();
+	static DWORD WINAPI writerThread(void *data);
+};
+
+/** Like console::formatter, but goes through the LogRing. */
+class LogFormatter : public pfc::string_formatter {
+public:
+	LogFormatter(LogCategory category, LogLevel level = LOG_INFO) : category(category), level(level) {
+	}
+
+	~LogFormatter() {
+		if (!is_empty())
+			LogRing::instance().write(category, level, get_ptr());
+	}
+
+private:
+	const LogCategory category;
+	const LogLevel level;
+};
@@ -0,0 +1,345 @@
+#include "pch.h"
+
+#include "metadata_cache.h"
+#include "config.h"
+#include "log_ring.h"
+
+#include <algorithm>
+#include <time.h>
+
+namespace {
+	const char MAGIC[4] = { 'F', 'I', 'S', 'M' };
+	const t_uint32 VERSION = 1;
+	const size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(VERSION);
+
+	/* Record layout, little endian, not aligned:
+	 *   u32 size of the rest of the record
+	 *   u32 time stored, u32 duration in ms
+	 *   u16 track number, u16 disc number, u16 year, u16 number of artists
+	 *   NUL-terminated: uri, title, album, album artist, each artist
+	 */
+	const size_t FIXED_SIZE = 2 * sizeof(t_uint32) + 4 * sizeof(t_uint16);
+
+	/** Past this the file can't be mapped, so it's started over. */
+	const t_uint64 MAX_FILE_SIZE = 0x7fffffff;
+	/** A file at least this large is compacted on open once less than half of it is live records. */
+	const size_t COMPACT_MIN_SIZE = 1 << 20;
+
+	template <typename T>
+	void append(std::vector<char> &out, T value) {
+		const char *p = reinterpret_cast<const char *>(&value);
+		out.insert(out.end(), p, p + sizeof(T));
+	}
+
+	void append(std::vector<char> &out, const std::string &value) {
+		out.insert(out.end(), value.c_str(), value.c_str() + value.size() + 1);
+	}
+
+	template <typename T>
+	T read(const char *p) {
+		T value;
+		memcpy(&value, p, sizeof(T));
+		return value;
+	}
+
+	/** @return false when there's no terminator before end. */
+	bool readString(const char *&p, const char *end, std::string *out) {
+		const char *terminator = static_cast<const char *>(memchr(p, 0, end - p));
+		if (terminator == NULL)
+			return false;
+		if (out)
+			out->assign(p, terminator);
+		p = terminator + 1;
+		return true;
+	}
+
+	t_uint32 now() {
+		return static_cast<t_uint32>(time(NULL));
+	}
+}
+
+MetadataCache::MetadataCache() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), viewSize(0) {
+}
+
+MetadataCache::~MetadataCache() {
+	close();
+}
+
+void MetadataCache::open(const std::wstring &directory) {
+	LockedCS lock(cs);
+	close();
+
+	const t_uint64 lifetimeDays = cfg_metadata_cache_days.get();
+	if (0 == lifetimeDays)
+		return;
+
+	const std::wstring path = directory + L"\\metadata.cache";
+	const t_uint32 notBefore = now() - static_cast<t_uint32>(pfc::min_t<t_uint64>(lifetimeDays * 24 * 60 * 60, now()));
+	if (load(path, notBefore) && viewSize >= COMPACT_MIN_SIZE && liveSize() < viewSize / 2) {
+		compact(path);
+		load(path, notBefore);
+	}
+}
+
+/** Opens, maps and indexes the file, starting it over if it's unusable.
+ * @return false when the cache is disabled. */
+bool MetadataCache::load(const std::wstring &path, t_uint32 notBefore) {
+	file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file) {
+		LogFormatter(LOG_SESSION, LOG_WARNING) << "metadata cache unavailable: " << format_win32_error(GetLastError());
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		close();
+		return false;
+	}
+
+	if (static_cast<t_uint64>(size.QuadPart) > MAX_FILE_SIZE
+			|| !map(static_cast<size_t>(size.QuadPart))
+			|| viewSize < HEADER_SIZE
+			|| memcmp(view, MAGIC, sizeof(MAGIC)) != 0
+			|| read<t_uint32>(view + sizeof(MAGIC)) != VERSION) {
+		if (!reset()) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	const size_t valid = index(notBefore);
+
+	if (valid != viewSize) {
+		// Cut off a record left half-written by a crash, so that appends line up again.
+		unmap();
+		LARGE_INTEGER end;
+		end.QuadPart = valid;
+		if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file) || !map(valid)) {
+			close();
+			return false;
+		}
+		index(notBefore);
+	}
+	return true;
+}
+
+/** Bytes taken by the records that are still indexed, header included. */
+size_t MetadataCache::liveSize() const {
+	size_t size = HEADER_SIZE;
+	for (std::map<std::string, size_t>::const_iterator it = mapped.begin(); it != mapped.end(); ++it)
+		size += sizeof(t_uint32) + read<t_uint32>(view + it->second);
+	return size;
+}
+
+/** Rewrites the file with only the indexed records, through a temporary file, and closes it.
+ * The old file stays if that fails. */
+void MetadataCache::compact(const std::wstring &path) {
+	// In file order, so that the records come out of the next index() the same way.
+	std::vector<size_t> offsets;
+	offsets.reserve(mapped.size());
+	for (std::map<std::string, size_t>::const_iterator it = mapped.begin(); it != mapped.end(); ++it)
+		offsets.push_back(it->second);
+	std::sort(offsets.begin(), offsets.end());
+
+	const size_t before = viewSize;
+	const size_t after = liveSize();
+
+	const std::wstring temp = path + L".tmp";
+	HANDLE out = CreateFileW(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == out) {
+		close();
+		return;
+	}
+
+	DWORD written;
+	bool ok = WriteFile(out, view, HEADER_SIZE, &written, NULL) && written == HEADER_SIZE;
+	for (std::vector<size_t>::const_iterator it = offsets.begin(); ok && it != offsets.end(); ++it) {
+		const DWORD size = static_cast<DWORD>(sizeof(t_uint32) + read<t_uint32>(view + *it));
+		ok = WriteFile(out, view + *it, size, &written, NULL) && written == size;
+	}
+	CloseHandle(out);
+	close();
+
+	if (ok && MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		LogFormatter(LOG_SESSION) << "compacted metadata cache from " << before << " to " << after << " bytes";
+		return;
+	}
+	DeleteFileW(temp.c_str());
+}
+
+void MetadataCache::close() {
+	unmap();
+	added.clear();
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool MetadataCache::map(size_t size) {
+	viewSize = size;
+	if (0 == size)
+		return true;
+
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (NULL == mapping)
+		return false;
+
+	view = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	return view != NULL;
+}
+
+void MetadataCache::unmap() {
+	mapped.clear();
+	if (view != NULL) {
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	if (mapping != NULL) {
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+	viewSize = 0;
+}
+
+/** Starts the file over with just a header. */
+bool MetadataCache::reset() {
+	unmap();
+
+	LARGE_INTEGER start;
+	start.QuadPart = 0;
+	if (!SetFilePointerEx(file, start, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+		return false;
+
+	std::vector<char> header(MAGIC, MAGIC + sizeof(MAGIC));
+	append(header, VERSION);
+
+	DWORD written;
+	return WriteFile(file, header.data(), static_cast<DWORD>(header.size()), &written, NULL) && written == header.size();
+}
+
+/** Indexes the mapped records; later records for the same uri win.
+ * @return the end of the last complete record. */
+size_t MetadataCache::index(t_uint32 notBefore) {
+	mapped.clear();
+
+	size_t offset = HEADER_SIZE;
+	while (offset + sizeof(t_uint32) <= viewSize) {
+		const size_t size = read<t_uint32>(view + offset);
+		if (size < FIXED_SIZE || size > viewSize - offset - sizeof(t_uint32))
+			break;
+
+		std::string uri;
+		t_uint32 storedAt;
+		if (!parse(offset, &uri, NULL, &storedAt))
+			break;
+
+		if (storedAt >= notBefore)
+			mapped[uri] = offset;
+		else
+			mapped.erase(uri);
+
+		offset += sizeof(t_uint32) + size;
+	}
+	return offset;
+}
+
+bool MetadataCache::parse(size_t offset, std::string *uri, TrackMetadata *out, t_uint32 *storedAt) const {
+	const char *p = view + offset;
+	const char *end = p + sizeof(t_uint32) + read<t_uint32>(p);
+	p += sizeof(t_uint32);
+
+	if (storedAt)
+		*storedAt = read<t_uint32>(p);
+	p += sizeof(t_uint32);
+
+	TrackMetadata dummy;
+	TrackMetadata &meta = out ? *out : dummy;
+
+	meta.durationMs = read<t_uint32>(p);
+	p += sizeof(t_uint32);
+	meta.trackNumber = read<t_uint16>(p);
+	p += sizeof(t_uint16);
+	meta.discNumber = read<t_uint16>(p);
+	p += sizeof(t_uint16);
+	meta.year = read<t_uint16>(p);
+	p += sizeof(t_uint16);
+	const t_uint16 artistCount = read<t_uint16>(p);
+	p += sizeof(t_uint16);
+
+	if (!readString(p, end, uri)
+			|| !readString(p, end, out ? &meta.title : NULL)
+			|| !readString(p, end, out ? &meta.album : NULL)
+			|| !readString(p, end, out ? &meta.albumArtist : NULL))
+		return false;
+
+	if (out)
+		meta.artists.resize(artistCount);
+	for (t_uint16 i = 0; i < artistCount; ++i) {
+		if (!readString(p, end, out ? &meta.artists[i] : NULL))
+			return false;
+	}
+
+	return true;
+}
+
+bool MetadataCache::contains(const std::string &uri) {
+	LockedCS lock(cs);
+	return added.count(uri) != 0 || mapped.count(uri) != 0;
+}
+
+bool MetadataCache::lookup(const std::string &uri, TrackMetadata &out) {
+	LockedCS lock(cs);
+
+	std::map<std::string, TrackMetadata>::const_iterator a = added.find(uri);
+	if (a != added.end()) {
+		out = a->second;
+		return true;
+	}
+
+	std::map<std::string, size_t>::const_iterator m = mapped.find(uri);
+	if (m != mapped.end())
+		return parse(m->second, NULL, &out, NULL);
+
+	return false;
+}
+
+void MetadataCache::store(const std::string &uri, const TrackMetadata &meta) {
+	if (uri.empty())
+		return;
+
+	std::vector<char> record;
+	append(record, t_uint32(0));
+	append(record, now());
+	append(record, t_uint32(meta.durationMs));
+	append(record, t_uint16(meta.trackNumber));
+	append(record, t_uint16(meta.discNumber));
+	append(record, t_uint16(meta.year));
+	append(record, t_uint16(meta.artists.size()));
+	append(record, uri);
+	append(record, meta.title);
+	append(record, meta.album);
+	append(record, meta.albumArtist);
+	for (std::vector<std::string>::const_iterator it = meta.artists.begin(); it != meta.artists.end(); ++it)
+		append(record, *it);
+
+	const t_uint32 size = static_cast<t_uint32>(record.size() - sizeof(t_uint32));
+	memcpy(record.data(), &size, sizeof(size));
+
+	LockedCS lock(cs);
+	if (INVALID_HANDLE_VALUE == file)
+		return;
+
+	added[uri] = meta;
+
+	LARGE_INTEGER zero;
+	zero.QuadPart = 0;
+	DWORD written;
+	if (!SetFilePointerEx(file, zero, NULL, FILE_END)
+			|| !WriteFile(file, record.data(), static_cast<DWORD>(record.size()), &written, NULL)
+			|| written != record.size()) {
+		LogFormatter(LOG_SESSION, LOG_WARNING) << "couldn't write metadata cache, disabling it";
+		close();
+	}
+}
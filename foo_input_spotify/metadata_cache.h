@@ -0,0 +1,61 @@
+#pragma once
+
+#include "util.h"
+#include <map>
+#include <string>
+#include <vector>
+
+struct TrackMetadata {
+	std::vector<std::string> artists;
+	std::string albumArtist;
+	std::string album;
+	std::string title;
+	int trackNumber;
+	int discNumber;
+	int year;
+	int durationMs;
+
+	TrackMetadata() : trackNumber(0), discNumber(0), year(0), durationMs(0) {
+	}
+};
+
+/** Persistent track metadata, keyed by track URI.
+ * Entries from previous runs are read straight out of a read-only mapping of the cache file,
+ * entries added during this run are kept in memory and appended to the file.
+ * A file with another format version is thrown away, and entries older than the configured lifetime are ignored.
+ * Failing to open or write the file only disables the cache.
+ * The file is only ever appended to while open; on open it's rewritten with just the live records once most of it is dead,
+ * and started over if it has grown too large to map.
+ */
+class MetadataCache : boost::noncopyable {
+public:
+	MetadataCache();
+	~MetadataCache();
+
+	void open(const std::wstring &directory);
+
+	bool contains(const std::string &uri);
+	bool lookup(const std::string &uri, TrackMetadata &out);
+	void store(const std::string &uri, const TrackMetadata &meta);
+
+private:
+	CriticalSection cs;
+	HANDLE file;
+	HANDLE mapping;
+	const char *view;
+	size_t viewSize;
+
+	/** Offsets of the records in view. */
+	std::map<std::string, size_t> mapped;
+	std::map<std::string, TrackMetadata> added;
+
+	void close();
+	bool reset();
+	bool load(const std::wstring &path, t_uint32 notBefore);
+	size_t liveSize() const;
+	void compact(const std::wstring &path);
+	bool map(size_t size);
+	void unmap();
+	size_t index(t_uint32 notBefore);
+	bool parse(size_t offset, std::string *uri, TrackMetadata *out, t_uint32 *storedAt) const;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "SpotifyPlusPlus.h"
+#include <vector>
+
+/** The tracks a spotify: link resolved to, shared between the session's link cache and every InputSpotify opened on it.
+ * Large playlists and artists are enumerated lazily: tracks stays empty and
+ * tracks are looked up by index, and waited for, only when asked for.
+ * Only touch it with the spotify lock held; the references it holds may be dropped anywhere.
+ */
+struct ResolvedLink : boost::noncopyable {
+	std::vector<SpotifyTrackPtr> tracks;
+	SpotifyPlaylistPtr playlist;
+	SpotifyArtistBrowsePtr artistBrowse;
+	t_uint32 trackCount;
+	/** Set once every track has been waited for (or was in the metadata cache), so later opens needn't check again. */
+	bool loaded;
+
+	ResolvedLink() : trackCount(0), loaded(false) {
+	}
+
+	/** Returns a reference of its own: a lazily enumerated track belongs to the playlist or browse,
+	 * which may let go of it as soon as the lock is dropped. */
+	SpotifyTrackPtr trackAt(t_uint32 subsong) const {
+		if (subsong >= trackCount)
+			throw exception_io_data("no such subsong");
+
+		if (!tracks.empty())
+			return tracks[subsong];
+
+		// A playlist may have shrunk since it was resolved; libspotify returns NULL past its end.
+		const int live = playlist ? sp_playlist_num_tracks(playlist) : sp_artistbrowse_num_tracks(artistBrowse);
+		if (static_cast<int>(subsong) >= live)
+			throw exception_io_not_found();
+
+		SpotifyTrackPtr track = playlist ? sp_playlist_track(playlist, subsong) : sp_artistbrowse_track(artistBrowse, subsong);
+		if (!track)
+			throw exception_io_not_found();
+		return track;
+	}
+};
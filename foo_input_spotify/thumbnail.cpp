@@ -0,0 +1,113 @@
+#include "pch.h"
+
+#include "thumbnail.h"
+
+#include <wincodec.h>
+
+namespace {
+	const float JPEG_QUALITY = 0.85f;
+
+	/** COM on the calling thread, for as long as it's in scope; whichever apartment it's in already is fine. */
+	struct ComScope : boost::noncopyable {
+		const bool initialized;
+
+		ComScope() : initialized(SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED))) {
+		}
+
+		~ComScope() {
+			if (initialized)
+				CoUninitialize();
+		}
+	};
+}
+
+album_art_data::ptr makeThumbnail(const album_art_data::ptr &image, unsigned maxPx) {
+	ComScope com;
+
+	pfc::com_ptr_t<IWICImagingFactory> factory;
+	pfc::com_ptr_t<IWICStream> input;
+	pfc::com_ptr_t<IWICBitmapDecoder> decoder;
+	pfc::com_ptr_t<IWICBitmapFrameDecode> frame;
+	UINT width = 0, height = 0;
+
+	HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, factory.receive_void_ptr());
+	if (SUCCEEDED(hr))
+		hr = factory->CreateStream(input.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = input->InitializeFromMemory(static_cast<BYTE *>(const_cast<void *>(image->get_ptr())), static_cast<DWORD>(image->get_size()));
+	if (SUCCEEDED(hr))
+		hr = factory->CreateDecoderFromStream(input.get_ptr(), NULL, WICDecodeMetadataCacheOnDemand, decoder.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = decoder->GetFrame(0, frame.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = frame->GetSize(&width, &height);
+	if (FAILED(hr) || 0 == width || 0 == height)
+		return album_art_data::ptr();
+
+	if (width <= maxPx && height <= maxPx)
+		return image;
+
+	const UINT scaledWidth = width >= height ? maxPx : pfc::max_t<UINT>(1, static_cast<UINT>(static_cast<t_uint64>(width) * maxPx / height));
+	const UINT scaledHeight = width >= height ? pfc::max_t<UINT>(1, static_cast<UINT>(static_cast<t_uint64>(height) * maxPx / width)) : maxPx;
+
+	pfc::com_ptr_t<IWICBitmapScaler> scaler;
+	pfc::com_ptr_t<IWICFormatConverter> converter;
+	pfc::com_ptr_t<IStream> output;
+	pfc::com_ptr_t<IWICBitmapEncoder> encoder;
+	pfc::com_ptr_t<IWICBitmapFrameEncode> encoded;
+	pfc::com_ptr_t<IPropertyBag2> options;
+	WICPixelFormatGUID format = GUID_WICPixelFormat24bppBGR;
+
+	hr = factory->CreateBitmapScaler(scaler.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = scaler->Initialize(frame.get_ptr(), scaledWidth, scaledHeight, WICBitmapInterpolationModeFant);
+	if (SUCCEEDED(hr))
+		hr = factory->CreateFormatConverter(converter.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = converter->Initialize(scaler.get_ptr(), GUID_WICPixelFormat24bppBGR, WICBitmapDitherTypeNone, NULL, 0.0, WICBitmapPaletteTypeCustom);
+	if (SUCCEEDED(hr))
+		hr = CreateStreamOnHGlobal(NULL, TRUE, output.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = factory->CreateEncoder(GUID_ContainerFormatJpeg, NULL, encoder.receive_ptr());
+	if (SUCCEEDED(hr))
+		hr = encoder->Initialize(output.get_ptr(), WICBitmapEncoderNoCache);
+	if (SUCCEEDED(hr))
+		hr = encoder->CreateNewFrame(encoded.receive_ptr(), options.receive_ptr());
+	if (SUCCEEDED(hr)) {
+		PROPBAG2 option = { 0 };
+		option.pstrName = const_cast<LPOLESTR>(L"ImageQuality");
+		VARIANT value;
+		VariantInit(&value);
+		value.vt = VT_R4;
+		value.fltVal = JPEG_QUALITY;
+		hr = options->Write(1, &option, &value);
+	}
+	if (SUCCEEDED(hr))
+		hr = encoded->Initialize(options.get_ptr());
+	if (SUCCEEDED(hr))
+		hr = encoded->SetSize(scaledWidth, scaledHeight);
+	if (SUCCEEDED(hr))
+		hr = encoded->SetPixelFormat(&format);
+	if (SUCCEEDED(hr))
+		hr = encoded->WriteSource(converter.get_ptr(), NULL);
+	if (SUCCEEDED(hr))
+		hr = encoded->Commit();
+	if (SUCCEEDED(hr))
+		hr = encoder->Commit();
+
+	STATSTG stat;
+	HGLOBAL memory = NULL;
+	if (SUCCEEDED(hr))
+		hr = output->Stat(&stat, STATFLAG_NONAME);
+	if (SUCCEEDED(hr))
+		hr = GetHGlobalFromStream(output.get_ptr(), &memory);
+	if (FAILED(hr))
+		return album_art_data::ptr();
+
+	const void *bytes = GlobalLock(memory);
+	if (NULL == bytes)
+		return album_art_data::ptr();
+	album_art_data::ptr thumbnail = album_art_data_impl::g_create(bytes, static_cast<t_size>(stat.cbSize.QuadPart));
+	GlobalUnlock(memory);
+	return thumbnail;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/** A JPEG of image scaled down to fit maxPx by maxPx, keeping its aspect ratio; image itself if it already fits.
+ * Decoding, scaling and encoding are up to the Windows Imaging Component. Null if any of that fails. */
+album_art_data::ptr makeThumbnail(const album_art_data::ptr &image, unsigned maxPx);
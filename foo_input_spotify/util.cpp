@@ -1,6 +1,49 @@
 #include "pch.h"
 #include "util.h"
 
+static LockSite *volatile lockSites = NULL;
+
+LockSite::LockSite(const char *function, int line)
+		: function(function), line(line), acquisitions(0), reacquisitions(0), waitTicks(0), maxWaitTicks(0), holdTicks(0) {
+	do {
+		next = lockSites;
+	} while (InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile *>(&lockSites), this, next) != next);
+}
+
+void LockSite::addWait(LONG64 ticks, bool reacquired) {
+	InterlockedIncrement64(reacquired ? &reacquisitions : &acquisitions);
+	InterlockedExchangeAdd64(&waitTicks, ticks);
+
+	LONG64 max = maxWaitTicks;
+	while (ticks > max) {
+		const LONG64 seen = InterlockedCompareExchange64(&maxWaitTicks, ticks, max);
+		if (seen == max)
+			break;
+		max = seen;
+	}
+}
+
+void LockSite::addHold(LONG64 ticks) {
+	InterlockedExchangeAdd64(&holdTicks, ticks);
+}
+
+void LockSite::report() {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	const double ms = 1000.0 / frequency.QuadPart;
+
+	for (LockSite *site = lockSites; site != NULL; site = site->next) {
+		if (0 == site->acquisitions)
+			continue;
+		console::formatter() << "spotify lock: " << site->function << ":" << site->line
+			<< " acquired " << site->acquisitions
+			<< " (reacquired " << site->reacquisitions << " after waits)"
+			<< ", waited " << pfc::format_float(site->waitTicks * ms, 0, 1) << " ms"
+			<< " (max " << pfc::format_float(site->maxWaitTicks * ms, 0, 1) << " ms)"
+			<< ", held " << pfc::format_float(site->holdTicks * ms, 0, 1) << " ms";
+	}
+}
+
 void LockedCS::wait(abort_callback &abort, DWORD timeoutMillis) {
 	UnlockedCS unlocked(*this);
 
@@ -23,7 +66,11 @@ void LockedCS::wait(abort_callback &abort, DWORD timeoutMillis) {
 bool LockedCS::waitForEvent(Event &ev, abort_callback &abort, DWORD timeoutMillis) {
 	UnlockedCS unlocked(*this);
 
-	HANDLE handles[2] = { ev.handle, abort.get_handle() };
+	return ev.wait(abort, timeoutMillis);
+}
+
+bool Event::wait(abort_callback &abort, DWORD timeoutMillis) {
+	HANDLE handles[2] = { handle, abort.get_handle() };
 	SetLastError(ERROR_SUCCESS);
 	DWORD result = WaitForMultipleObjects(2, handles, FALSE, timeoutMillis);
 	switch (result) {
@@ -44,60 +91,344 @@ bool LockedCS::waitForEvent(Event &ev, abort_callback &abort, DWORD timeoutMilli
 	}
 }
 
-Buffer::Buffer() : entries(0), ptr(0) {
-	InitializeConditionVariable(&bufferNotEmpty);
+PcmRing::PcmRing() : data(new char[CAPACITY]), writePos(0), readPos(0),
+		markersWritten(0), markersRead(0), consumerWaiting(false), dataAvailable(FALSE, FALSE),
+		flushPending(false), endOfTrackPending(false), playing(false), realtime(true), interrupted(false), stableBytes(0), targetMs(4000), configuredTargetMs(0), adaptive(false),
+		stopped(false), throttled(false), refillEvent(NULL),
+		pendingStutters(0), stutters(0), refillWakeups(0), refusedDeliveries(0), targetChanges(0), deferredMarkers(0) {
+	producerFormat.sampleRate = 0;
+	producerFormat.channels = 0;
+	consumerFormat = producerFormat;
+}
+
+PcmRing::~PcmRing() {
+	delete[] data;
+}
+
+int PcmRing::bytesToMs(size_t bytes, const PcmFormat &format) {
+	if (0 == format.sampleRate || 0 == format.channels)
+		return 0;
+	return static_cast<int>(static_cast<t_uint64>(bytes) * 1000 / (sizeof(int16_t) * format.channels * format.sampleRate));
+}
+
+void PcmRing::setRefillEvent(HANDLE ev) {
+	refillEvent = ev;
+}
+
+void PcmRing::setTarget(int ms, bool adapt) {
+	ms = pfc::max_t(MIN_TARGET_MS, pfc::min_t(ms, MAX_TARGET_MS));
+	if (ms != configuredTargetMs || adapt != adaptive.load()) {
+		configuredTargetMs = ms;
+		targetMs.store(ms);
+		adaptive.store(adapt);
+	}
+}
+
+int PcmRing::getTargetMs() const {
+	return targetMs.load();
+}
+
+/** Consumer side: half as much again after a stutter, a tenth less after a stable stretch. */
+void PcmRing::adaptTarget(bool stuttered) {
+	stableBytes = 0;
+	if (!adaptive.load())
+		return;
+
+	const int current = targetMs.load();
+	const int next = stuttered
+		? pfc::min_t(current * 3 / 2, MAX_TARGET_MS)
+		: pfc::max_t(current * 9 / 10, MIN_TARGET_MS);
+	if (next != current) {
+		targetMs.store(next);
+		InterlockedIncrement64(&targetChanges);
+	}
+}
+
+void PcmRing::interrupt() {
+	interrupted.store(true);
+	SetEvent(dataAvailable.handle);
+}
+
+void PcmRing::setRealtime(bool rt) {
+	realtime = rt;
+	playing = false;
+}
+
+void PcmRing::startDelivery() {
+	stopped.store(false);
+}
+
+void PcmRing::stopDelivery() {
+	stopped.store(true);
+}
+
+int PcmRing::bufferedFrames() const {
+	if (0 == producerFormat.channels)
+		return 0;
+	const size_t buffered = writePos.load(std::memory_order_relaxed) - readPos.load(std::memory_order_acquire);
+	return static_cast<int>(buffered / (sizeof(int16_t) * producerFormat.channels));
+}
+
+int PcmRing::takeStutters() {
+	return pendingStutters.exchange(0);
+}
+
+/** Consumer side: lifts the throttle once we're down to the low watermark, and has libspotify deliver again. */
+void PcmRing::refillIfDrained() {
+	if (!throttled.load())
+		return;
+
+	const size_t buffered = writePos.load() - readPos.load(std::memory_order_relaxed);
+	if (bytesToMs(buffered, consumerFormat) > targetMs.load() / 2)
+		return;
+
+	if (throttled.exchange(false)) {
+		InterlockedIncrement64(&refillWakeups);
+		if (refillEvent != NULL)
+			SetEvent(refillEvent);
+	}
+}
+
+void PcmRing::report() {
+	console::formatter() << "spotify buffer: " << stutters << " stutters, "
+		<< refillWakeups << " refill wakeups, "
+		<< refusedDeliveries << " refused deliveries, "
+		<< "target " << targetMs.load() << " ms (changed " << targetChanges << " times), "
+		<< deferredMarkers << " deferred markers";
 }
 
-Buffer::~Buffer() {
-	flush();
+void PcmRing::wakeConsumer() {
+	if (consumerWaiting.exchange(false))
+		SetEvent(dataAvailable.handle);
+}
+
+bool PcmRing::pushMarker(MarkerType type, const PcmFormat &format, size_t padding) {
+	const size_t w = markersWritten.load(std::memory_order_relaxed);
+	if (w - markersRead.load(std::memory_order_acquire) >= MAX_MARKERS)
+		return false;
+
+	Marker &m = markers[w % MAX_MARKERS];
+	m.type = type;
+	m.position = writePos.load(std::memory_order_relaxed);
+	m.format = format;
+	m.padding = padding;
+	markersWritten.store(w + 1);
+
+	wakeConsumer();
+	return true;
 }
 
-void Buffer::add(void *data, size_t size, int sampleRate, int channels) {
-	Gentry *e = new Gentry;
-	e->data = data;
-	e->size = size;
-	e->sampleRate = sampleRate;
-	e->channels = channels;
+size_t PcmRing::write(const void *src, size_t size, int sampleRate, int channels) {
+	// Audio after a pending marker would reach the consumer before it.
+	if (stopped.load() || throttled.load() || flushPending.load() || endOfTrackPending.load()) {
+		InterlockedIncrement64(&refusedDeliveries);
+		return 0;
+	}
+
+	const size_t frameSize = sizeof(int16_t) * channels;
 
-	{
-		LockedCS lock(bufferLock);
+	if (sampleRate != producerFormat.sampleRate || channels != producerFormat.channels) {
+		// After mono audio, the write position may be half way into a stereo frame; skip to the next whole one.
+		const size_t w = writePos.load(std::memory_order_relaxed);
+		const size_t padding = (frameSize - w % frameSize) % frameSize;
+		if (CAPACITY - (w - readPos.load(std::memory_order_acquire)) < padding)
+			return 0;
 
-		// Yes, this is spinlock.  See the class comment.
-		while (entries >= MAX_ENTRIES)
-			lock.dropAndReacquire();
+		PcmFormat format = { sampleRate, channels };
+		if (!pushMarker(MARKER_FORMAT, format, padding))
+			return 0;
+		producerFormat = format;
 
-		entry[(ptr + entries) % MAX_ENTRIES] = e;
-		++entries;
+		// Only after the marker, so the consumer never takes the padding for audio in the old format.
+		if (padding != 0) {
+			writePos.store(w + padding);
+			wakeConsumer();
+		}
 	}
-	WakeConditionVariable(&bufferNotEmpty);
+
+	const size_t w = writePos.load(std::memory_order_relaxed);
+	const size_t space = CAPACITY - (w - readPos.load(std::memory_order_acquire));
+	size = pfc::min_t<size_t>(size, space) / frameSize * frameSize;
+	if (0 == size)
+		return 0;
+
+	const size_t offset = w & (CAPACITY - 1);
+	const size_t first = pfc::min_t<size_t>(size, CAPACITY - offset);
+	memcpy(data + offset, src, first);
+	memcpy(data, static_cast<const char *>(src) + first, size - first);
+
+	writePos.store(w + size);
+	wakeConsumer();
+
+	if (bytesToMs(w + size - readPos.load(), producerFormat) >= targetMs.load())
+		throttled.store(true);
+	return size;
 }
 
-bool Buffer::isFull() {
-	return entries >= MAX_ENTRIES - SPACE_FOR_UTILITY_MESSAGES;
+bool PcmRing::endOfTrack() {
+	if (!endOfTrackPending.load() && !flushPending.load() && pushMarker(MARKER_END_OF_TRACK, producerFormat))
+		return true;
+	InterlockedIncrement64(&deferredMarkers);
+	endOfTrackPending.store(true);
+	return false;
 }
 
-void Buffer::flush() {
-	while (entries > 0)
-		free(take(NULL));
+bool PcmRing::flushFromProducer() {
+	// While one is pending, retryMarkers() may be pushing it; a second flush would only repeat it.
+	if (!flushPending.load() && pushMarker(MARKER_FLUSH, producerFormat))
+		return true;
+	InterlockedIncrement64(&deferredMarkers);
+	flushPending.store(true);
+	return false;
 }
 
-Gentry *Buffer::take(abort_callback *p_abort) {
-	LockedCS lock(bufferLock);
-	while (entries == 0) {
-		SleepConditionVariableCS(&bufferNotEmpty, &bufferLock.cs, 200);
-		if (p_abort)
-			p_abort->check();
+void PcmRing::retryMarkers() {
+	// Cleared only after the push, so the producer doesn't push a marker of its own meanwhile.
+	if (flushPending.load() && pushMarker(MARKER_FLUSH, producerFormat))
+		flushPending.store(false);
+	if (endOfTrackPending.load() && !flushPending.load() && pushMarker(MARKER_END_OF_TRACK, producerFormat))
+		endOfTrackPending.store(false);
+}
+
+/** Skips to the last pending flush marker, if any, keeping track of format changes on the way. */
+void PcmRing::applyFlushes() {
+	const size_t available = markersWritten.load(std::memory_order_acquire);
+	size_t r = markersRead.load(std::memory_order_relaxed);
+
+	size_t lastFlush = available;
+	for (size_t i = r; i != available; ++i) {
+		if (MARKER_FLUSH == markers[i % MAX_MARKERS].type)
+			lastFlush = i;
 	}
 
-	Gentry *e = entry[ptr++];
-	--entries;
-	if (MAX_ENTRIES == ptr)
-		ptr = 0;
+	if (lastFlush == available)
+		return;
 
-	return e;
+	for (; r != lastFlush; ++r) {
+		const Marker &m = markers[r % MAX_MARKERS];
+		if (MARKER_FORMAT == m.type)
+			consumerFormat = m.format;
+	}
+
+	readPos.store(markers[lastFlush % MAX_MARKERS].position);
+	markersRead.store(lastFlush + 1);
+	playing = false;
+	refillIfDrained();
 }
 
-void Buffer::free(Gentry *e) {
-	delete[] e->data;
-	delete e;
+PcmRing::ReadResult PcmRing::read(const int16_t *&out, size_t &size, PcmFormat &format, abort_callback &abort) {
+	while (true) {
+		if (interrupted.exchange(false))
+			return READ_INTERRUPTED;
+
+		applyFlushes();
+
+		// writePos before the markers: every marker pushed before the audio we can see is then visible too.
+		const size_t w = writePos.load();
+
+		const size_t r = readPos.load(std::memory_order_relaxed);
+		size_t end = w;
+		bool awaitingPadding = false;
+
+		const size_t m = markersRead.load(std::memory_order_relaxed);
+		if (m != markersWritten.load(std::memory_order_acquire)) {
+			const Marker &marker = markers[m % MAX_MARKERS];
+			if (MARKER_FLUSH == marker.type)
+				continue;
+			if (marker.position == r) {
+				// The producer publishes a format marker's padding just after the marker.
+				awaitingPadding = w - r < marker.padding;
+				if (!awaitingPadding) {
+					markersRead.store(m + 1);
+					if (MARKER_END_OF_TRACK == marker.type) {
+						playing = false;
+						return READ_END_OF_TRACK;
+					}
+					consumerFormat = marker.format;
+					if (marker.padding != 0)
+						readPos.store(r + marker.padding);
+					continue;
+				}
+				end = r;
+			}
+			else if (marker.position - r < w - r) {
+				end = marker.position;
+			}
+		}
+
+		if (end != r) {
+			const size_t offset = r & (CAPACITY - 1);
+			out = reinterpret_cast<const int16_t *>(data + offset);
+			size = pfc::min_t<size_t>(end - r, CAPACITY - offset);
+			format = consumerFormat;
+			playing = true;
+			return READ_DATA;
+		}
+
+		// Ran dry mid track, and not because libspotify stopped playback.
+		if (playing && realtime && !stopped.load() && !awaitingPadding) {
+			playing = false;
+			++pendingStutters;
+			InterlockedIncrement64(&stutters);
+			adaptTarget(true);
+		}
+
+		// Every marker has been read, so there's room for the pending ones.
+		if ((flushPending.load() || endOfTrackPending.load()) && refillEvent != NULL)
+			SetEvent(refillEvent);
+
+		consumerWaiting.store(true);
+		if (writePos.load() != w || markersWritten.load() != m) {
+			consumerWaiting.store(false);
+			continue;
+		}
+
+		HANDLE handles[2] = { dataAvailable.handle, abort.get_handle() };
+		SetLastError(ERROR_SUCCESS);
+		DWORD result = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+		switch (result) {
+		case WAIT_OBJECT_0:
+			break;
+		case WAIT_OBJECT_0 + 1:
+			consumerWaiting.store(false);
+			throw exception_aborted();
+		case WAIT_FAILED:
+			throw win32exception("WAIT_FAILED");
+		default:
+			throw win32exception("unexpected wait result");
+		}
+	}
+}
+
+void PcmRing::consume(size_t size) {
+	readPos.store(readPos.load(std::memory_order_relaxed) + size);
+
+	stableBytes += size;
+	if (realtime && bytesToMs(static_cast<size_t>(stableBytes), consumerFormat) >= STABLE_PERIOD_MS)
+		adaptTarget(false);
+
+	refillIfDrained();
+}
+
+void PcmRing::flush() {
+	const size_t w = writePos.load();
+	const size_t r = readPos.load(std::memory_order_relaxed);
+	const size_t available = markersWritten.load(std::memory_order_acquire);
+
+	size_t m = markersRead.load(std::memory_order_relaxed);
+	for (; m != available; ++m) {
+		const Marker &marker = markers[m % MAX_MARKERS];
+		if (marker.position + marker.padding - r > w - r)
+			break;
+		if (MARKER_FORMAT == marker.type)
+			consumerFormat = marker.format;
+	}
+
+	markersRead.store(m);
+	readPos.store(w);
+	playing = false;
+	// Whatever they were for has been dropped along with the audio.
+	flushPending.store(false);
+	endOfTrackPending.store(false);
+	refillIfDrained();
 }
@@ -3,6 +3,8 @@
 #define MYVERSION "0.0.4"
 
 #include "boost/noncopyable.hpp"
+#include <atomic>
+#include <stdint.h>
 #include <string>
 #include <sstream>
 
@@ -20,13 +22,6 @@ struct win32exception : std::exception {
 	}
 };
 
-struct Gentry {
-	void *data;
-    size_t size;
-	int sampleRate;
-	int channels;
-};
-
 struct Event : boost::noncopyable {
 	HANDLE handle;
 
@@ -49,6 +44,9 @@ struct Event : boost::noncopyable {
 			throw win32exception("could not copy event");
 		return h;
 	}
+
+	/** @return false on timeout; throws exception_aborted when aborted first. */
+	bool wait(abort_callback &abort, DWORD timeoutMillis = INFINITE);
 };
 
 struct CriticalSection : boost::noncopyable {
@@ -62,20 +60,89 @@ struct CriticalSection : boost::noncopyable {
 	}
 };
 
+/** Wait and hold times at one place that takes a lock, for measuring contention.
+ * Meant to be a function-local static, see DECLARE_LOCK_SITE; sites register themselves for report(). */
+struct LockSite : boost::noncopyable {
+	const char *function;
+	int line;
+	volatile LONG64 acquisitions;
+	/** Taking the lock back after dropping it to wait (UnlockedCS); its wait still counts, but it's not a new acquisition. */
+	volatile LONG64 reacquisitions;
+	volatile LONG64 waitTicks;
+	volatile LONG64 maxWaitTicks;
+	volatile LONG64 holdTicks;
+	LockSite *next;
+
+	LockSite(const char *function, int line);
+
+	void addWait(LONG64 ticks, bool reacquired);
+	void addHold(LONG64 ticks);
+
+	static LONG64 now() {
+		LARGE_INTEGER ticks;
+		QueryPerformanceCounter(&ticks);
+		return ticks.QuadPart;
+	}
+
+	/** Logs the totals of every site used so far to the console. */
+	static void report();
+};
+
+#define DECLARE_LOCK_SITE(var) static LockSite var(__FUNCTION__, __LINE__)
+
 struct LockedCS : boost::noncopyable {
 	CRITICAL_SECTION &cs;
-	LockedCS(CriticalSection &o) : cs(o.cs) {
-		EnterCriticalSection(&cs);
+	LockSite *site;
+	LONG64 acquiredAt;
+	/** Whether a low priority thread runs at normal priority while it holds the lock. */
+	bool raisePriority;
+	/** What to put the thread's priority back to on release; THREAD_PRIORITY_NORMAL if it wasn't raised. */
+	int loweredPriority;
+
+	LockedCS(CriticalSection &o) : cs(o.cs), site(NULL), acquiredAt(0), raisePriority(false), loweredPriority(THREAD_PRIORITY_NORMAL) {
+		acquire();
+	}
+
+	/** Instrumented: accounts wait and hold times to the site. */
+	LockedCS(CriticalSection &o, LockSite &site, bool raisePriority = false)
+		: cs(o.cs), site(&site), acquiredAt(0), raisePriority(raisePriority), loweredPriority(THREAD_PRIORITY_NORMAL) {
+		acquire();
 	}
 
 	~LockedCS() {
+		release();
+	}
+
+	void acquire(bool reacquired = false) {
+		if (raisePriority) {
+			const int priority = GetThreadPriority(GetCurrentThread());
+			if (priority != THREAD_PRIORITY_ERROR_RETURN && priority < THREAD_PRIORITY_NORMAL && SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL))
+				loweredPriority = priority;
+		}
+		if (site == NULL) {
+			EnterCriticalSection(&cs);
+			return;
+		}
+		const LONG64 before = LockSite::now();
+		EnterCriticalSection(&cs);
+		acquiredAt = LockSite::now();
+		site->addWait(acquiredAt - before, reacquired);
+	}
+
+	void release() {
+		if (site != NULL)
+			site->addHold(LockSite::now() - acquiredAt);
 		LeaveCriticalSection(&cs);
+		if (loweredPriority != THREAD_PRIORITY_NORMAL) {
+			SetThreadPriority(GetCurrentThread(), loweredPriority);
+			loweredPriority = THREAD_PRIORITY_NORMAL;
+		}
 	}
 
 	void dropAndReacquire(DWORD wait = 0) {
-		LeaveCriticalSection(&cs);
+		release();
 		Sleep(wait);
-		EnterCriticalSection(&cs);
+		acquire(true);
 	}
 
 	void wait(abort_callback &abort, DWORD timeoutMillis);
@@ -119,41 +186,165 @@ struct ConditionVariable : boost::noncopyable {
 };
 
 struct UnlockedCS : boost::noncopyable {
-	CRITICAL_SECTION &cs;
+	LockedCS &lock;
 
-	UnlockedCS(const LockedCS &lock) : cs(lock.cs) {
-		LeaveCriticalSection(&cs);
+	UnlockedCS(LockedCS &lock) : lock(lock) {
+		lock.release();
 	}
 
 	~UnlockedCS() {
-		EnterCriticalSection(&cs);
+		lock.acquire(true);
 	}
 };
 
-/** A fixed sized, thread-safe queue with blocking take(), but without an efficient blocking add implementation.
- * Expected use: Main producer, secondary notification producers, single consumer. 
- * Main producer is expected to back-off when queue is full.
+/** Sample format of the data in a PcmRing. */
+struct PcmFormat {
+	int sampleRate;
+	int channels;
+};
+
+/** A fixed sized, lock-free ring of interleaved 16-bit PCM with a single producer and a single consumer.
+ * Producer: libspotify's delivery thread (music_delivery, end_of_track).
+ * Consumer: whichever InputSpotify currently owns the decoder.
  *
- * In hindsight, a dual-lock queue would've been simpler.  Originally there wern't multiple producers..
+ * Format changes, end of track and flushes travel through a small marker channel.
+ * Each marker is tagged with the ring position it applies at, so it is seen in order with the audio.
+ * An end of track or flush that finds the channel full is kept pending, and audio refused, until retryMarkers() gets it in.
+ * The consumer only blocks, on an event, when there is neither audio nor a marker to read.
+ *
+ * Delivery is flow controlled: once the target duration of audio is buffered, or while libspotify has stopped playback,
+ * the producer refuses audio; the consumer wakes the session thread to refill once it has drained to half the target.
+ * In adaptive mode the consumer grows the target after each stutter, and shrinks it again after a stretch without any.
  */
-struct Buffer : boost::noncopyable {
+struct PcmRing : boost::noncopyable {
+
+	/** Must be a power of two. Frames never straddle the wrap: libspotify delivers one or two channels,
+	 * and audio in a new format starts at a multiple of its frame size (see Marker::padding). */
+	static const size_t CAPACITY = 1 << 20;
+	static const size_t MAX_MARKERS = 64;
+	/** Bounds of the buffer target; the upper one still fits the ring at 48 kHz stereo. */
+	static const int MIN_TARGET_MS = 500;
+	static const int MAX_TARGET_MS = 5000;
+	/** Adaptive mode: audio to play without a stutter before the target is shrunk. */
+	static const int STABLE_PERIOD_MS = 60 * 1000;
+
+	enum MarkerType {
+		MARKER_FORMAT,
+		MARKER_END_OF_TRACK,
+		MARKER_FLUSH,
+	};
+
+	struct Marker {
+		MarkerType type;
+		size_t position;
+		PcmFormat format;
+		/** MARKER_FORMAT: bytes skipped after position, to align the write position on the new frame size. */
+		size_t padding;
+	};
+
+	enum ReadResult {
+		READ_DATA,
+		READ_END_OF_TRACK,
+		/** interrupt() was called. */
+		READ_INTERRUPTED,
+	};
+
+	PcmRing();
+	~PcmRing();
+
+	// Producer side.
 
-	size_t entries;
-	size_t ptr;
+	/** @return number of bytes accepted, a whole number of frames; 0 when the ring is full, or a marker is pending. */
+	size_t write(const void *data, size_t size, int sampleRate, int channels);
+	/** From end_of_track, on the session thread. @return false when the marker channel was full, and the marker is pending. */
+	bool endOfTrack();
+	/** From music_delivery. @return false when the marker channel was full, and the marker is pending. */
+	bool flushFromProducer();
+	/** Session thread: pushes pending markers, a flush before an end of track, once the consumer has made room.
+	 * The consumer signals the refill event when it runs dry with markers pending. */
+	void retryMarkers();
+	/** Frames of audio buffered, in the format last written. */
+	int bufferedFrames() const;
+	/** Stutters since the last call, for get_audio_buffer_stats. */
+	int takeStutters();
 
-	static const size_t MAX_ENTRIES = 255;
-	static const size_t SPACE_FOR_UTILITY_MESSAGES = 5;
+	// Either side; from libspotify's start_playback and stop_playback.
 
-	Gentry *entry[MAX_ENTRIES];
+	void startDelivery();
+	void stopDelivery();
 
-	CONDITION_VARIABLE bufferNotEmpty;
-	CriticalSection bufferLock;
+	/** Signalled when the ring has drained enough to take more audio; typically the session's process events event. */
+	void setRefillEvent(HANDLE ev);
+	/** Makes the consumer's current, or next, read() return READ_INTERRUPTED. */
+	void interrupt();
 
-	Buffer();
-	~Buffer();
-	void add(void *data, size_t size, int sampleRate, int channels);
-	bool isFull();
+	/** How much audio to buffer, and whether to adapt that to the delivery; the target is only reset when these change. */
+	void setTarget(int targetMs, bool adaptive);
+	int getTargetMs() const;
+
+	// Consumer side.
+
+	/** Blocks until audio or an end of track is available.
+	 * On READ_DATA, data and size (in bytes) describe a contiguous span of the ring in the given format;
+	 * it stays valid until it, or a prefix of it, is handed back with consume(). */
+	ReadResult read(const int16_t *&data, size_t &size, PcmFormat &format, abort_callback &abort);
+	void consume(size_t size);
 	void flush();
-	Gentry *take(abort_callback *p_abort);
-	void free(Gentry *e);
+	/** Whether the audio is being played as it's read; when it's not, running dry isn't a stutter. */
+	void setRealtime(bool realtime);
+
+	/** Logs the flow control counters to the console. */
+	void report();
+
+private:
+	char *data;
+
+	std::atomic<size_t> writePos;
+	std::atomic<size_t> readPos;
+
+	Marker markers[MAX_MARKERS];
+	std::atomic<size_t> markersWritten;
+	std::atomic<size_t> markersRead;
+
+	std::atomic<bool> consumerWaiting;
+	Event dataAvailable;
+
+	/** Set by whichever producer call found the marker channel full, cleared by retryMarkers() or a consumer flush. */
+	std::atomic<bool> flushPending;
+	std::atomic<bool> endOfTrackPending;
+
+	/** Owned by the producer: the format of the last write. */
+	PcmFormat producerFormat;
+	/** Owned by the consumer: the format of the data at readPos. */
+	PcmFormat consumerFormat;
+	/** Owned by the consumer: whether running dry now would be a stutter, i.e. we're mid track. */
+	bool playing;
+	/** Owned by the consumer. */
+	bool realtime;
+	std::atomic<bool> interrupted;
+	/** Owned by the consumer: audio played since the last stutter or adaptation, in bytes of consumerFormat. */
+	t_uint64 stableBytes;
+
+	std::atomic<int> targetMs;
+	int configuredTargetMs;
+	std::atomic<bool> adaptive;
+
+	std::atomic<bool> stopped;
+	/** Set by the producer at the high watermark, cleared by the consumer at the low one. */
+	std::atomic<bool> throttled;
+	HANDLE refillEvent;
+
+	std::atomic<int> pendingStutters;
+	volatile LONG64 stutters;
+	volatile LONG64 refillWakeups;
+	volatile LONG64 refusedDeliveries;
+	volatile LONG64 targetChanges;
+	volatile LONG64 deferredMarkers;
+
+	bool pushMarker(MarkerType type, const PcmFormat &format, size_t padding = 0);
+	void wakeConsumer();
+	void applyFlushes();
+	void refillIfDrained();
+	void adaptTarget(bool stuttered);
+	static int bytesToMs(size_t bytes, const PcmFormat &format);
 };
@@ -0,0 +1,409 @@
+#include "pch.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <new>
+
+/** Runs a producer and a consumer thread against one PcmRing, the way libspotify's delivery thread and
+ * InputSpotify use it, and checks that every sample arrives once, in order, in the format and track it was written in.
+ * Mono and stereo segments of odd lengths alternate, so format changes land mid frame and the ring wraps often.
+ * Once both sides are running, neither may allocate. */
+
+static std::atomic<long> allocations(0);
+
+void *operator new(size_t size) {
+	++allocations;
+	void *p = malloc(size != 0 ? size : 1);
+	if (NULL == p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+struct Segment {
+	int sampleRate;
+	int channels;
+	size_t frames;
+	bool endOfTrack;
+};
+
+static const size_t SEGMENTS = 400;
+static const size_t MAX_SEGMENT_FRAMES = 40000;
+static const size_t MAX_CHUNK_FRAMES = 4096;
+/** As in InputSpotify::decode_run. */
+static const size_t MAX_CHUNK_SAMPLES = 8192;
+
+static Segment plan[SEGMENTS];
+static PcmRing ring;
+static audio_chunk_impl chunk;
+static long chunksDecoded = 0;
+
+/** Deterministic, and independent per thread. */
+static unsigned nextRandom(unsigned &state) {
+	state = state * 1103515245 + 12345;
+	return (state >> 8) & 0xffffff;
+}
+
+static void fail(const char *what, size_t segment) {
+	printf("pcm_ring_test: FAILED in segment %u: %s\n", static_cast<unsigned>(segment), what);
+	fflush(stdout);
+	ExitProcess(1);
+}
+
+static void makePlan() {
+	static const PcmFormat formats[] = { { 44100, 2 }, { 44100, 1 }, { 48000, 2 }, { 22050, 1 } };
+	unsigned state = 1;
+	for (size_t i = 0; i < SEGMENTS; ++i) {
+		const PcmFormat &format = formats[nextRandom(state) % 4];
+		plan[i].sampleRate = format.sampleRate;
+		plan[i].channels = format.channels;
+		plan[i].frames = 1 + nextRandom(state) % MAX_SEGMENT_FRAMES;
+		plan[i].endOfTrack = nextRandom(state) % 4 == 0;
+
+		// Without a marker in between, the consumer could not tell two segments apart.
+		if (i > 0 && plan[i].sampleRate == plan[i - 1].sampleRate && plan[i].channels == plan[i - 1].channels)
+			plan[i - 1].endOfTrack = true;
+	}
+}
+
+static DWORD WINAPI produce(LPVOID) {
+	static int16_t chunk[MAX_CHUNK_FRAMES * 2];
+	unsigned state = 2;
+	uint16_t next = 0;
+
+	for (size_t i = 0; i < SEGMENTS; ++i) {
+		const Segment &segment = plan[i];
+		const size_t frameSize = sizeof(int16_t) * segment.channels;
+
+		for (size_t left = segment.frames; left != 0; ) {
+			const size_t frames = pfc::min_t<size_t>(left, 1 + nextRandom(state) % MAX_CHUNK_FRAMES);
+			for (size_t s = 0; s < frames * segment.channels; ++s)
+				chunk[s] = static_cast<int16_t>(next++);
+
+			const char *src = reinterpret_cast<const char *>(chunk);
+			size_t size = frames * frameSize;
+			while (size != 0) {
+				const size_t written = ring.write(src, size, segment.sampleRate, segment.channels);
+				if (written % frameSize != 0)
+					fail("write accepted a partial frame", i);
+				if (0 == written)
+					Sleep(0);
+				src += written;
+				size -= written;
+			}
+			left -= frames;
+		}
+
+		if (segment.endOfTrack) {
+			while (!ring.endOfTrack())
+				Sleep(0);
+		}
+	}
+	return 0;
+}
+
+static DWORD WINAPI consume(LPVOID) {
+	abort_callback_dummy abort;
+	unsigned state = 3;
+	uint16_t expected = 0;
+
+	for (size_t i = 0; i < SEGMENTS; ++i) {
+		const Segment &segment = plan[i];
+		const size_t frameSize = sizeof(int16_t) * segment.channels;
+
+		for (size_t left = segment.frames * frameSize; left != 0; ) {
+			const int16_t *data;
+			size_t size;
+			PcmFormat format;
+			if (ring.read(data, size, format, abort) != PcmRing::READ_DATA)
+				fail("marker before the end of the segment's audio", i);
+			if (format.sampleRate != segment.sampleRate || format.channels != segment.channels)
+				fail("audio in the wrong format", i);
+			if (size % frameSize != 0 || reinterpret_cast<uintptr_t>(data) % frameSize != 0)
+				fail("span is not a whole number of frames", i);
+			if (size > left)
+				fail("span runs past the next marker", i);
+
+			// Hand back a prefix at times, as decode_run does when it has filled its chunk.
+			if (nextRandom(state) % 2 == 0)
+				size = frameSize * (1 + nextRandom(state) % (size / frameSize));
+			const size_t samples = pfc::min_t<size_t>(size / sizeof(int16_t), MAX_CHUNK_SAMPLES / segment.channels * segment.channels);
+			size = samples * sizeof(int16_t);
+
+			// Decode into the chunk the way decode_run does.
+			chunk.grow_data_size(MAX_CHUNK_SAMPLES);
+			audio_sample *out = chunk.get_data();
+			for (size_t s = 0; s < samples; ++s) {
+				if (static_cast<uint16_t>(data[s]) != expected++)
+					fail("sample out of order", i);
+				out[s] = data[s] * (1.0f / 0x8000);
+			}
+			chunk.set_sample_count(samples / segment.channels);
+			chunk.set_srate(format.sampleRate);
+			chunk.set_channels(format.channels, audio_chunk::g_guess_channel_config(format.channels));
+			++chunksDecoded;
+
+			ring.consume(size);
+			left -= size;
+		}
+
+		if (segment.endOfTrack) {
+			const int16_t *data;
+			size_t size;
+			PcmFormat format;
+			if (ring.read(data, size, format, abort) != PcmRing::READ_END_OF_TRACK)
+				fail("missing end of track", i);
+		}
+	}
+	return 0;
+}
+
+/** A format change lands mid frame, and a flush from the producer skips past it before the consumer gets there. */
+static void testFlushAcrossFormatChange() {
+	PcmRing flushed;
+	flushed.setRealtime(false);
+	abort_callback_dummy abort;
+
+	const int16_t mono[3] = { 1, 2, 3 };
+	const int16_t stereo[4] = { 10, 11, 12, 13 };
+	flushed.write(mono, sizeof(mono), 44100, 1);
+	flushed.write(stereo, sizeof(stereo), 44100, 2);
+	flushed.flushFromProducer();
+	flushed.write(stereo, sizeof(stereo), 44100, 2);
+
+	const int16_t *data;
+	size_t size;
+	PcmFormat format;
+	if (flushed.read(data, size, format, abort) != PcmRing::READ_DATA)
+		fail("no audio after the flush", 0);
+	if (format.channels != 2 || size != sizeof(stereo) || memcmp(data, stereo, size) != 0)
+		fail("wrong audio after the flush", 0);
+	if (reinterpret_cast<uintptr_t>(data) % (2 * sizeof(int16_t)) != 0)
+		fail("stereo audio after mono is not frame aligned", 0);
+}
+
+/** An end of track that finds the marker channel full waits, with audio held back, until the consumer has made room
+ * and the session thread retries it; the consumer wakes the session thread once it runs dry. */
+static void testEndOfTrackDeferredWhenFull() {
+	PcmRing full;
+	full.setRealtime(false);
+	Event refill(FALSE, FALSE);
+	full.setRefillEvent(refill.handle);
+
+	const int16_t stereo[2] = { 1, 2 };
+	full.write(stereo, sizeof(stereo), 44100, 2);
+	for (size_t i = 1; i < PcmRing::MAX_MARKERS; ++i) {
+		if (!full.endOfTrack())
+			fail("marker channel full too early", i);
+	}
+	if (full.endOfTrack())
+		fail("end of track pushed into a full marker channel", 0);
+	if (full.write(stereo, sizeof(stereo), 44100, 2) != 0)
+		fail("audio accepted ahead of a pending end of track", 0);
+	full.retryMarkers();
+
+	abort_callback_dummy abort;
+	const int16_t *data;
+	size_t size;
+	PcmFormat format;
+	if (full.read(data, size, format, abort) != PcmRing::READ_DATA)
+		fail("audio missing before the markers", 0);
+	full.consume(size);
+	for (size_t i = 1; i < PcmRing::MAX_MARKERS; ++i) {
+		if (full.read(data, size, format, abort) != PcmRing::READ_END_OF_TRACK)
+			fail("end of track missing", i);
+	}
+
+	abort_callback_impl aborted;
+	aborted.abort();
+	try {
+		full.read(data, size, format, aborted);
+		fail("read past the last marker", 0);
+	}
+	catch (exception_aborted &) {
+	}
+	if (WaitForSingleObject(refill.handle, 0) != WAIT_OBJECT_0)
+		fail("session thread not woken for the pending end of track", 0);
+
+	full.retryMarkers();
+	if (full.read(data, size, format, abort) != PcmRing::READ_END_OF_TRACK)
+		fail("deferred end of track lost", 0);
+	if (full.write(stereo, sizeof(stereo), 44100, 2) != sizeof(stereo))
+		fail("audio still refused after the deferred end of track", 0);
+}
+
+static int msOf(size_t bytes) {
+	return static_cast<int>(bytes * 1000 / (44100 * 2 * sizeof(int16_t)));
+}
+
+/** Past the target the producer is refused; at half the target the throttle lifts and the session thread is woken.
+ * Running dry mid track is a stutter, but only while playing in realtime. */
+static void testFlowControl() {
+	PcmRing ring;
+	ring.setRealtime(true);
+	ring.setTarget(PcmRing::MIN_TARGET_MS, false);
+	Event refill(FALSE, FALSE);
+	ring.setRefillEvent(refill.handle);
+
+	static const int16_t silence[MAX_CHUNK_FRAMES * 2] = {};
+	const size_t targetBytes = PcmRing::MIN_TARGET_MS * 44100 / 1000 * 2 * sizeof(int16_t);
+	size_t buffered = 0;
+	while (true) {
+		const size_t written = ring.write(silence, sizeof(silence), 44100, 2);
+		if (0 == written)
+			break;
+		buffered += written;
+	}
+	if (buffered < targetBytes || buffered >= targetBytes + sizeof(silence))
+		fail("throttled away from the target", 0);
+	if (WaitForSingleObject(refill.handle, 0) == WAIT_OBJECT_0)
+		fail("refill signalled while full", 0);
+
+	abort_callback_dummy abort;
+	const int16_t *data;
+	size_t size;
+	PcmFormat format;
+	while (msOf(buffered) > PcmRing::MIN_TARGET_MS / 2) {
+		if (ring.write(silence, sizeof(silence), 44100, 2) != 0)
+			fail("audio accepted above half the target", 0);
+		if (WaitForSingleObject(refill.handle, 0) == WAIT_OBJECT_0)
+			fail("refill signalled above half the target", 0);
+		if (ring.read(data, size, format, abort) != PcmRing::READ_DATA)
+			fail("buffered audio missing", 0);
+		size = pfc::min_t<size_t>(size, 256);
+		ring.consume(size);
+		buffered -= size;
+	}
+	if (WaitForSingleObject(refill.handle, 0) != WAIT_OBJECT_0)
+		fail("refill not signalled at half the target", 0);
+	const size_t more = ring.write(silence, sizeof(silence), 44100, 2);
+	if (0 == more)
+		fail("still throttled below half the target", 0);
+	buffered += more;
+
+	abort_callback_impl aborted;
+	aborted.abort();
+	while (buffered != 0) {
+		ring.read(data, size, format, abort);
+		ring.consume(size);
+		buffered -= size;
+	}
+	try {
+		ring.read(data, size, format, aborted);
+	}
+	catch (exception_aborted &) {
+	}
+	if (ring.takeStutters() != 1 || ring.takeStutters() != 0)
+		fail("running dry while playing is not one stutter", 0);
+
+	ring.setRealtime(false);
+	ring.write(silence, sizeof(silence), 44100, 2);
+	ring.read(data, size, format, abort);
+	ring.consume(size);
+	try {
+		ring.read(data, size, format, aborted);
+	}
+	catch (exception_aborted &) {
+	}
+	if (ring.takeStutters() != 0)
+		fail("running dry while not playing in realtime counted as a stutter", 0);
+}
+
+/** Plays SIMULATED_SECONDS of 44.1 kHz stereo in 20 ms ticks. libspotify delivers twice as fast as playback
+ * whenever the ring takes audio, except for a stall of STALL_MS every STALL_EVERY_MS.
+ * @return the target at the end; stutters is set to how many there were. */
+static int simulateJitter(bool adaptive, int &stutters) {
+	static const int TICK_MS = 20;
+	static const int SIMULATED_SECONDS = 600;
+	static const int STALL_EVERY_MS = 10 * 1000;
+	static const int STALL_MS = 700;
+	static const size_t TICK_BYTES = 44100 * TICK_MS / 1000 * 2 * sizeof(int16_t);
+	static const int16_t silence[TICK_BYTES / sizeof(int16_t)] = {};
+
+	PcmRing ring;
+	ring.setRealtime(true);
+	ring.setTarget(PcmRing::MIN_TARGET_MS, adaptive);
+
+	// Reads that would block throw instead.
+	abort_callback_impl dry;
+	dry.abort();
+	stutters = 0;
+
+	for (int now = 0; now < SIMULATED_SECONDS * 1000; now += TICK_MS) {
+		if (now % STALL_EVERY_MS >= STALL_MS) {
+			for (int i = 0; i < 2; ++i)
+				ring.write(silence, TICK_BYTES, 44100, 2);
+		}
+
+		for (size_t played = 0; played < TICK_BYTES; ) {
+			const int16_t *data;
+			size_t size;
+			PcmFormat format;
+			try {
+				ring.read(data, size, format, dry);
+			}
+			catch (exception_aborted &) {
+				break;
+			}
+			size = pfc::min_t(size, TICK_BYTES - played);
+			ring.consume(size);
+			played += size;
+		}
+		stutters += ring.takeStutters();
+	}
+	return ring.getTargetMs();
+}
+
+/** A fixed target too small for the stalls stutters at every one; the adaptive one grows past them after a few. */
+static void testAdaptiveTarget() {
+	int fixedStutters, adaptiveStutters;
+	const int fixedTarget = simulateJitter(false, fixedStutters);
+	const int adaptiveTarget = simulateJitter(true, adaptiveStutters);
+	printf("pcm_ring_test: jittered delivery: fixed target %d ms, %d stutters; adaptive target %d ms, %d stutters\n",
+		fixedTarget, fixedStutters, adaptiveTarget, adaptiveStutters);
+
+	if (fixedTarget != PcmRing::MIN_TARGET_MS)
+		fail("fixed target changed", 0);
+	if (fixedStutters < 50)
+		fail("stalls longer than the fixed target didn't stutter", 0);
+	if (adaptiveTarget <= PcmRing::MIN_TARGET_MS || adaptiveTarget > PcmRing::MAX_TARGET_MS)
+		fail("adaptive target didn't grow within bounds", 0);
+	if (adaptiveStutters * 4 > fixedStutters)
+		fail("adaptive target didn't cut stutters", 0);
+}
+
+int main() {
+	testFlushAcrossFormatChange();
+	testEndOfTrackDeferredWhenFull();
+	testFlowControl();
+	testAdaptiveTarget();
+
+	makePlan();
+	ring.setRealtime(false);
+	chunk.grow_data_size(MAX_CHUNK_SAMPLES);
+
+	const long allocationsBefore = allocations.load();
+
+	HANDLE threads[2];
+	threads[0] = CreateThread(NULL, 0, produce, NULL, 0, NULL);
+	threads[1] = CreateThread(NULL, 0, consume, NULL, 0, NULL);
+	if (NULL == threads[0] || NULL == threads[1]) {
+		printf("pcm_ring_test: CreateThread failed\n");
+		return 1;
+	}
+	WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+	CloseHandle(threads[0]);
+	CloseHandle(threads[1]);
+
+	const long allocated = allocations.load() - allocationsBefore;
+	if (allocated != 0) {
+		printf("pcm_ring_test: FAILED: %ld allocations over %ld chunks\n", allocated, chunksDecoded);
+		return 1;
+	}
+
+	printf("pcm_ring_test: passed, %u segments in %ld chunks without allocating\n", static_cast<unsigned>(SEGMENTS), chunksDecoded);
+	return 0;
+}